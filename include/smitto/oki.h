@@ -0,0 +1 @@
+#include "../../src/OrderedKeyIngest.hpp"
@@ -0,0 +1 @@
+#include "../../src/OrderedKeyJoin.hpp"
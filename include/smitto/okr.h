@@ -0,0 +1 @@
+#include "../../src/OrderedKeyRegistry.hpp"
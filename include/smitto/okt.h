@@ -0,0 +1 @@
+#include "../../src/OrderedKeyTable.hpp"
@@ -0,0 +1 @@
+#include "../../src/OrderedKeyJournal.hpp"
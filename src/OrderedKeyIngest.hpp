@@ -0,0 +1,433 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#pragma once
+
+#include "OrderedKeyMap.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Smitto {
+
+template <typename KTYPE, typename TYPE>
+struct IngestBatch
+{
+	std::vector<KTYPE> keys;
+	std::vector<TYPE> values;
+
+	inline void add(KTYPE key, TYPE value) {keys.push_back(key); values.push_back(std::move(value));}
+	inline std::ptrdiff_t size() const {return keys.size();}
+	inline bool empty() const {return keys.empty();}
+	inline void clear() {keys.clear(); values.clear();}
+	void reserve(std::ptrdiff_t n) {keys.reserve(n); values.reserve(n);}
+};
+
+// Staged ingest: a decoder thread fills batches with push(), the thread owning the map appends
+// whole batches with drain(). The lock is taken once per batch, batches are recycled.
+// push() blocks while maxBatches batches wait for the owner.
+template <typename MAP>
+class OrderedKeyMapIngest
+{
+public:
+	typedef typename MAP::key_type KTYPE;
+	typedef typename MAP::mapped_type TYPE;
+	typedef typename MAP::size_type size_type;
+	typedef IngestBatch<KTYPE, TYPE> Batch;
+
+	OrderedKeyMapIngest(size_type batchSize = BASESIZE, int maxBatches = 16) : batchSize_(batchSize), maxBatches_(maxBatches)
+		{filling_.reserve(batchSize_);}
+
+// decoder thread
+	inline void push(KTYPE key, TYPE value) {filling_.add(key, std::move(value)); if (filling_.size() >= batchSize_) flush();}
+	void flush();
+	void close() {flush(); std::lock_guard<std::mutex> lock(mutex_); closed_ = true; ready_.notify_all();}
+
+// owner thread
+	size_type drain(MAP& map);
+	// waits for a batch or close(), returns false once closed and drained
+	bool waitAndDrain(MAP& map);
+
+private:
+	static void append(MAP& map, const Batch& batch);
+
+private:
+	const size_type batchSize_;
+	const int maxBatches_;
+	Batch filling_;
+	std::mutex mutex_;
+	std::condition_variable ready_;
+	std::condition_variable space_;
+	std::deque<Batch> queue_;
+	std::vector<Batch> spare_;
+	bool closed_ = false;
+};
+
+template <typename MAP>
+void OrderedKeyMapIngest<MAP>::flush()
+{
+	if (filling_.empty())
+		return;
+	std::unique_lock<std::mutex> lock(mutex_);
+	space_.wait(lock, [this]() {return int(queue_.size()) < maxBatches_;});
+	queue_.push_back(std::move(filling_));
+	if (spare_.empty())
+	{
+		filling_ = Batch();
+		filling_.reserve(batchSize_);
+	}
+	else
+	{
+		filling_ = std::move(spare_.back());
+		spare_.pop_back();
+	}
+	lock.unlock();
+	ready_.notify_one();
+}
+
+template <typename MAP>
+typename OrderedKeyMapIngest<MAP>::size_type OrderedKeyMapIngest<MAP>::drain(MAP& map)
+{
+	std::deque<Batch> batches;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		batches.swap(queue_);
+	}
+	if (batches.empty())
+		return 0;
+	space_.notify_all();
+	size_type count = 0;
+	for (auto& batch : batches)
+	{
+		append(map, batch);
+		count += batch.size();
+		batch.clear();
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto& batch : batches)
+		spare_.push_back(std::move(batch));
+	return count;
+}
+
+template <typename MAP>
+bool OrderedKeyMapIngest<MAP>::waitAndDrain(MAP& map)
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		ready_.wait(lock, [this]() {return !queue_.empty() || closed_;});
+		if (queue_.empty())
+			return false;
+	}
+	drain(map);
+	return true;
+}
+
+template <typename MAP>
+void OrderedKeyMapIngest<MAP>::append(MAP& map, const Batch& batch)
+{
+	if (map.appendBulk(batch.keys.data(), batch.values.data(), batch.size()))
+		return;
+	// an ordered batch with late keys: they take the insert path, the rest is one appendBulk()
+	size_type late = 0;
+	if (std::adjacent_find(batch.keys.begin(), batch.keys.end(), std::greater_equal<KTYPE>()) == batch.keys.end())
+	{
+		late = map.isEmpty() ? 0 : std::upper_bound(batch.keys.begin(), batch.keys.end(), map.lastKey()) - batch.keys.begin();
+		for (size_type i = 0; i < late; i++)
+			map.insert(batch.keys[i], batch.values[i]);
+		if (map.appendBulk(batch.keys.data() + late, batch.values.data() + late, batch.size() - late))
+			return;
+	}
+	// unordered keys, or ones appendBulk() cannot encode, take the ordinary insert path
+	for (size_type i = late; i < batch.size(); i++)
+		map.insert(batch.keys[i], batch.values[i]);
+}
+
+/// ------------------------------------------------------------------------------------------------
+
+// Bounded single producer single consumer ring. Each side caches the other's index
+// and reads it again only when the ring looks full or empty.
+template <typename T>
+class SpscRing
+{
+public:
+	explicit SpscRing(std::size_t capacity) : mask_(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1), items_(new T[mask_ + 1]) {}
+
+	inline std::size_t capacity() const {return mask_ + 1;}
+	// from any thread: the tail read after the head is not behind it, the consumer and the producer
+	// moving on between the two reads may overstate the size, so it is clamped
+	inline std::size_t size() const {
+		auto head = head_.load(std::memory_order_acquire);
+		auto tail = tail_.load(std::memory_order_acquire);
+		return std::min<std::size_t>(tail - head, capacity());}
+	inline std::uint64_t pushed() const {return tail_.load(std::memory_order_acquire);}
+
+// producer
+	inline bool tryPush(T&& item) {
+		auto tail = tail_.load(std::memory_order_relaxed);
+		if (tail - headCache_ > mask_)
+		{
+			headCache_ = head_.load(std::memory_order_acquire);
+			if (tail - headCache_ > mask_)
+				return false;
+		}
+		items_[tail & mask_] = std::move(item);
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;}
+
+// consumer: fn(item&) for up to max items, returns their number
+	template <typename FN>
+	std::size_t popBulk(const FN& fn, std::size_t max) {
+		auto head = head_.load(std::memory_order_relaxed);
+		if (tailCache_ == head)
+			tailCache_ = tail_.load(std::memory_order_acquire);
+		auto n = std::min<std::size_t>(tailCache_ - head, max);
+		for (std::size_t i = 0; i < n; i++)
+			fn(items_[(head + i) & mask_]);
+		head_.store(head + n, std::memory_order_release);
+		return n;}
+
+private:
+	const std::size_t mask_;
+	std::unique_ptr<T[]> items_;
+	alignas(64) std::atomic<std::size_t> head_{0};
+	std::size_t tailCache_ = 0;
+	alignas(64) std::atomic<std::size_t> tail_{0};
+	std::size_t headCache_ = 0;
+};
+
+struct IngestMetrics
+{
+	std::uint64_t pushed = 0;
+	std::uint64_t drained = 0;
+	std::uint64_t depth = 0;         // queued in all rings now
+	std::uint64_t maxDepth = 0;      // largest depth a drain started with
+	std::uint64_t fullWaits = 0;     // pushes that found their ring full
+	std::uint64_t drains = 0;
+	std::uint64_t latencySamples = 0;
+	std::uint64_t latencyAvgNs = 0;  // from push to the end of the drain, of sampled items
+	std::uint64_t latencyMaxNs = 0;
+};
+
+// Lock-free front-end for several producer threads: each producer gets its own SPSC ring,
+// the thread owning the map drains all rings, merges them in key order and appends with appendBulk().
+// A full ring is the backpressure: push() waits for the owner, tryPush() reports it.
+template <typename MAP>
+class OrderedKeyMapMpscIngest
+{
+public:
+	typedef typename MAP::key_type KTYPE;
+	typedef typename MAP::mapped_type TYPE;
+	typedef typename MAP::size_type size_type;
+
+private:
+	struct Item
+	{
+		KTYPE key;
+		TYPE value;
+		std::int64_t stamp;  // push time of sampled items, 0 for others
+	};
+	struct Ring
+	{
+		explicit Ring(std::size_t capacity) : items(capacity) {}
+		SpscRing<Item> items;
+		std::atomic<bool> used{true};
+		std::atomic<std::uint64_t> fullWaits{0};
+		unsigned sample = 0;  // producer side
+	};
+
+public:
+	// Pushing side of one producer thread; its ring is reused by a later producer once it is destroyed.
+	class Producer
+	{
+	public:
+		Producer(Producer&& o) : ring_(std::exchange(o.ring_, nullptr)), sampleEvery_(o.sampleEvery_) {}
+		~Producer() {if (ring_) ring_->used.store(false, std::memory_order_release);}
+		Producer(const Producer&) = delete;
+		Producer& operator = (const Producer&) = delete;
+
+		inline bool isValid() const {return ring_;}
+		inline bool tryPush(KTYPE key, TYPE value) {
+			std::int64_t stamp = ++ring_->sample % sampleEvery_ ? 0 : now();
+			if (ring_->items.tryPush(Item{key, std::move(value), stamp}))
+				return true;
+			ring_->fullWaits.fetch_add(1, std::memory_order_relaxed);
+			return false;}
+		void push(KTYPE key, TYPE value) {
+			Item item{key, std::move(value), ++ring_->sample % sampleEvery_ ? 0 : now()};
+			if (ring_->items.tryPush(std::move(item)))
+				return;
+			ring_->fullWaits.fetch_add(1, std::memory_order_relaxed);
+			for (int spin = 0; !ring_->items.tryPush(std::move(item)); spin++)
+				if (spin > 64)
+					std::this_thread::yield();}
+
+	private:
+		friend class OrderedKeyMapMpscIngest;
+		Producer(Ring* ring, unsigned sampleEvery) : ring_(ring), sampleEvery_(sampleEvery) {}
+		Ring* ring_;
+		unsigned sampleEvery_;
+	};
+
+	// drainLimit bounds the items taken from one ring per drain, and with it the owner's time per drain
+	explicit OrderedKeyMapMpscIngest(std::size_t ringCapacity = BASESIZE, int maxProducers = 64,
+			std::size_t drainLimit = BASESIZE, unsigned latencySampleEvery = 64)
+		: ringCapacity_(ringCapacity), drainLimit_(drainLimit), sampleEvery_(std::max(1u, latencySampleEvery)),
+		  rings_(new std::unique_ptr<Ring>[maxProducers]), maxProducers_(maxProducers) {}
+
+	// any thread, the producer is invalid once maxProducers producers are alive
+	Producer producer();
+
+// owner thread
+	// Appends what the producers queued, returns the number of items taken.
+	size_type drain(MAP& map);
+	IngestMetrics metrics() const;
+
+private:
+	static inline std::int64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();}
+
+private:
+	const std::size_t ringCapacity_;
+	const std::size_t drainLimit_;
+	const unsigned sampleEvery_;
+	std::unique_ptr<std::unique_ptr<Ring>[]> rings_;
+	const int maxProducers_;
+	std::atomic<int> ringCount_{0};
+	std::mutex producersMutex_;  // producer registration only
+
+	// owner thread
+	std::vector<std::pair<KTYPE, TYPE>> merged_;
+	std::vector<std::int64_t> stamps_;
+	std::vector<std::size_t> runs_;
+	std::atomic<std::uint64_t> drained_{0}, maxDepth_{0}, drains_{0}, latencySamples_{0}, latencySumNs_{0}, latencyMaxNs_{0};
+};
+
+template <typename MAP>
+typename OrderedKeyMapMpscIngest<MAP>::Producer OrderedKeyMapMpscIngest<MAP>::producer()
+{
+	std::lock_guard<std::mutex> lock(producersMutex_);
+	int count = ringCount_.load(std::memory_order_relaxed);
+	for (int i = 0; i < count; i++)
+	{
+		bool used = false;
+		if (rings_[i]->used.compare_exchange_strong(used, true, std::memory_order_acquire))
+			return Producer(rings_[i].get(), sampleEvery_);
+	}
+	if (count == maxProducers_)
+		return Producer(nullptr, sampleEvery_);
+	rings_[count] = std::make_unique<Ring>(ringCapacity_);
+	ringCount_.store(count + 1, std::memory_order_release);
+	return Producer(rings_[count].get(), sampleEvery_);
+}
+
+template <typename MAP>
+typename OrderedKeyMapMpscIngest<MAP>::size_type OrderedKeyMapMpscIngest<MAP>::drain(MAP& map)
+{
+	merged_.clear();
+	stamps_.clear();
+	runs_.clear();
+	int count = ringCount_.load(std::memory_order_acquire);
+	std::uint64_t depth = 0;
+	bool runsSorted = true;
+	for (int i = 0; i < count; i++)
+	{
+		auto& ring = rings_[i]->items;
+		depth += ring.size();
+		runs_.push_back(merged_.size());
+		ring.popBulk([this](Item& item) {
+			if (item.stamp)
+				stamps_.push_back(item.stamp);
+			merged_.emplace_back(item.key, std::move(item.value));
+		}, drainLimit_);
+		for (auto j = runs_.back() + 1; j < merged_.size() && runsSorted; j++)
+			runsSorted = merged_[j-1].first <= merged_[j].first;
+	}
+	if (merged_.empty())
+		return 0;
+	runs_.push_back(merged_.size());
+	if (depth > maxDepth_.load(std::memory_order_relaxed))
+		maxDepth_.store(depth, std::memory_order_relaxed);
+
+	size_type taken = merged_.size();
+	// producers keep their own keys ordered: merge the runs, otherwise sort; equal keys keep their push order
+	auto keyLess = [](const auto& a, const auto& b) {return a.first < b.first;};
+	if (runsSorted)
+		for (std::size_t r = 2; r < runs_.size(); r++)
+			std::inplace_merge(merged_.begin(), merged_.begin() + runs_[r-1], merged_.begin() + runs_[r], keyLess);
+	else
+		std::stable_sort(merged_.begin(), merged_.end(), keyLess);
+	// the last value of a repeated key wins, as with insert()
+	std::size_t unique = 0;
+	for (std::size_t i = 0; i < merged_.size(); i++)
+	{
+		if (unique && merged_[unique-1].first == merged_[i].first)
+			merged_[unique-1].second = std::move(merged_[i].second);
+		else if (unique++ != i)
+			merged_[unique-1] = std::move(merged_[i]);
+	}
+	merged_.resize(unique);
+
+	// late keys take the insert path, the rest is one appendBulk()
+	std::size_t late = map.isEmpty() ? 0 : std::upper_bound(merged_.begin(), merged_.end(), map.lastKey(),
+			[](KTYPE key, const auto& item) {return key < item.first;}) - merged_.begin();
+	for (std::size_t i = 0; i < late; i++)
+		map.insert(merged_[i].first, std::move(merged_[i].second));
+	if (!map.appendBulk(std::span(merged_.begin() + late, merged_.end())))
+	{
+		// keys appendBulk() cannot encode take the ordinary insert path, as in OrderedKeyMapIngest
+		for (std::size_t i = late; i < merged_.size(); i++)
+			map.insert(merged_[i].first, std::move(merged_[i].second));
+	}
+
+	drained_.fetch_add(taken, std::memory_order_relaxed);
+	drains_.fetch_add(1, std::memory_order_relaxed);
+	if (!stamps_.empty())
+	{
+		auto done = now();
+		std::uint64_t sum = 0, max = latencyMaxNs_.load(std::memory_order_relaxed);
+		for (auto stamp : stamps_)
+		{
+			sum += done - stamp;
+			max = std::max<std::uint64_t>(max, done - stamp);
+		}
+		latencySumNs_.fetch_add(sum, std::memory_order_relaxed);
+		latencySamples_.fetch_add(stamps_.size(), std::memory_order_relaxed);
+		latencyMaxNs_.store(max, std::memory_order_relaxed);
+	}
+	return taken;
+}
+
+template <typename MAP>
+IngestMetrics OrderedKeyMapMpscIngest<MAP>::metrics() const
+{
+	IngestMetrics res;
+	int count = ringCount_.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++)
+	{
+		res.pushed += rings_[i]->items.pushed();
+		res.depth += rings_[i]->items.size();
+		res.fullWaits += rings_[i]->fullWaits.load(std::memory_order_relaxed);
+	}
+	res.drained = drained_.load(std::memory_order_relaxed);
+	res.maxDepth = maxDepth_.load(std::memory_order_relaxed);
+	res.drains = drains_.load(std::memory_order_relaxed);
+	res.latencySamples = latencySamples_.load(std::memory_order_relaxed);
+	res.latencyAvgNs = res.latencySamples ? latencySumNs_.load(std::memory_order_relaxed)/res.latencySamples : 0;
+	res.latencyMaxNs = latencyMaxNs_.load(std::memory_order_relaxed);
+	return res;
+}
+
+} // Smitto::
@@ -0,0 +1,201 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#pragma once
+
+#include "OrderedKeyMap.hpp"
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define OKM_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define OKM_PREFETCH(addr)
+#endif
+
+// Joins of two ordered containers by a single co-iteration over their keys.
+// Works with OrderedKeyMap and OrderedKeyTable (anything with keysView() and key_type).
+
+namespace Smitto {
+
+constexpr std::ptrdiff_t JoinNoMatch = -1;
+
+struct JoinPositions
+{
+	std::ptrdiff_t left;
+	std::ptrdiff_t right;
+	bool operator == (const JoinPositions& o) const {return left == o.left && right == o.right;}
+};
+
+// First position in [from, count) whose key does not satisfy before(key): steps 1, 2, 4... then bisects the last step.
+template <typename KEYS, typename PRED>
+static inline std::ptrdiff_t gallop(const KEYS& keys, std::ptrdiff_t from, std::ptrdiff_t count, const PRED& before)
+{
+	if (from >= count || !before(keys[from]))
+		return from;
+	std::ptrdiff_t lo = from, step = 1;
+	while (lo + step < count && before(keys[lo + step]))
+	{
+		lo += step;
+		step *= 2;
+	}
+	std::ptrdiff_t hi = std::min(lo + step, count);
+	while (lo + 1 < hi)
+	{
+		auto mid = (lo + hi)/2;
+		before(keys[mid]) ? lo = mid : hi = mid;
+	}
+	return hi;
+}
+
+template <typename KEYS>
+static inline void prefetchKey(const KEYS& keys, std::ptrdiff_t pos, std::ptrdiff_t count)
+{
+	constexpr std::ptrdiff_t distance = 64;
+	if constexpr (std::is_lvalue_reference_v<decltype(keys[0])>)
+		if (pos + distance < count)
+			OKM_PREFETCH(&keys[pos + distance]);
+}
+
+// Splits left positions into threads chunks; right positions are split at the same keys.
+// job(leftBegin, leftEnd, rightBegin, rightEnd, result) fills the chunk result, results are concatenated in order.
+template <typename RESULT, typename LKEYS, typename RKEYS, typename JOB>
+static void joinByKeyRanges(const LKEYS& left, std::ptrdiff_t lcount, const RKEYS& right, std::ptrdiff_t rcount,
+		int threads, RESULT& result, const JOB& job)
+{
+	if (threads <= 1 || lcount < 2*threads)
+	{
+		job(0, lcount, 0, rcount, result);
+		return;
+	}
+	std::vector<std::ptrdiff_t> lbounds(threads + 1), rbounds(threads + 1);
+	for (int t = 0; t <= threads; t++)
+	{
+		lbounds[t] = lcount*t/threads;
+		if (t == 0)
+			rbounds[t] = 0;
+		else if (t == threads)
+			rbounds[t] = rcount;
+		else
+		{
+			auto key = left[lbounds[t]];
+			rbounds[t] = gallop(right, rbounds[t-1], rcount, [key](auto k) {return k < key;});
+		}
+	}
+	std::vector<RESULT> parts(threads);
+	std::vector<std::thread> workers;
+	workers.reserve(threads - 1);
+	for (int t = 1; t < threads; t++)
+		workers.emplace_back([&, t]() {job(lbounds[t], lbounds[t+1], rbounds[t], rbounds[t+1], parts[t]);});
+	job(lbounds[0], lbounds[1], rbounds[0], rbounds[1], parts[0]);
+	for (auto& worker : workers)
+		worker.join();
+	result.clear();
+	for (auto& part : parts)
+		result.insert(result.end(), part.begin(), part.end());
+}
+
+// For every left key the position of the last right key at or before it,
+// JoinNoMatch when there is none or it is more than tolerance older.
+template <typename LEFT, typename RIGHT>
+std::vector<std::ptrdiff_t> asOfJoin(const LEFT& left, const RIGHT& right,
+		typename LEFT::key_type tolerance = std::numeric_limits<typename LEFT::key_type>::max(), int threads = 1)
+{
+	auto lkeys = left.keysView();
+	auto rkeys = right.keysView();
+	std::ptrdiff_t lcount = left.count(), rcount = right.count();
+	std::vector<std::ptrdiff_t> result;
+	joinByKeyRanges(lkeys, lcount, rkeys, rcount, threads, result,
+			[&](std::ptrdiff_t lb, std::ptrdiff_t le, std::ptrdiff_t rb, std::ptrdiff_t, std::vector<std::ptrdiff_t>& out) {
+		out.resize(le - lb);
+		// right keys before the chunk still match its first left keys
+		std::ptrdiff_t j = rb > 0 ? rb - 1 : 0;
+		for (auto i = lb; i < le; i++)
+		{
+			auto key = lkeys[i];
+			j = gallop(rkeys, j, rcount, [key](auto k) {return k <= key;});
+			prefetchKey(rkeys, j, rcount);
+			out[i - lb] = j > 0 && key - rkeys[j-1] <= tolerance ? j - 1 : JoinNoMatch;
+		}
+	});
+	return result;
+}
+
+// Left keys with the values of their as-of matches; left keys without a match are skipped.
+template <typename KTYPE, typename LTYPE, FindAlgorithm LALGORITHM, CopyMode LCOPYMODE, StatsMode LSTATSMODE, KeyEncoding LKEYENCODING,
+		  typename RTYPE, FindAlgorithm RALGORITHM, CopyMode RCOPYMODE, StatsMode RSTATSMODE, KeyEncoding RKEYENCODING>
+OrderedKeyMap<KTYPE, RTYPE, LALGORITHM> asOfJoinValues(
+		const OrderedKeyMap<KTYPE, LTYPE, LALGORITHM, LCOPYMODE, LSTATSMODE, LKEYENCODING>& left,
+		const OrderedKeyMap<KTYPE, RTYPE, RALGORITHM, RCOPYMODE, RSTATSMODE, RKEYENCODING>& right,
+		KTYPE tolerance = std::numeric_limits<KTYPE>::max(), int threads = 1)
+{
+	auto positions = asOfJoin(left, right, tolerance, threads);
+	OrderedKeyMap<KTYPE, RTYPE, LALGORITHM> result(left.count());
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(positions.size()); i++)
+		if (positions[i] != JoinNoMatch)
+			result.insert(left.keyAt(i), right.dataAt(positions[i]).value);
+	return result;
+}
+
+// Position pairs of keys present in both containers.
+template <typename LEFT, typename RIGHT>
+std::vector<JoinPositions> innerJoin(const LEFT& left, const RIGHT& right, int threads = 1)
+{
+	auto lkeys = left.keysView();
+	auto rkeys = right.keysView();
+	std::vector<JoinPositions> result;
+	joinByKeyRanges(lkeys, left.count(), rkeys, right.count(), threads, result,
+			[&](std::ptrdiff_t i, std::ptrdiff_t le, std::ptrdiff_t j, std::ptrdiff_t re, std::vector<JoinPositions>& out) {
+		while (i < le && j < re)
+		{
+			auto lkey = lkeys[i], rkey = rkeys[j];
+			if (lkey < rkey)
+				i = gallop(lkeys, i, le, [rkey](auto k) {return k < rkey;});
+			else if (rkey < lkey)
+			{
+				j = gallop(rkeys, j, re, [lkey](auto k) {return k < lkey;});
+				prefetchKey(rkeys, j, re);
+			}
+			else
+				out.push_back({i++, j++});
+		}
+	});
+	return result;
+}
+
+// Position pairs of all keys of both containers in key order, JoinNoMatch on the side missing the key.
+template <typename LEFT, typename RIGHT>
+std::vector<JoinPositions> outerJoin(const LEFT& left, const RIGHT& right, int threads = 1)
+{
+	auto lkeys = left.keysView();
+	auto rkeys = right.keysView();
+	std::vector<JoinPositions> result;
+	joinByKeyRanges(lkeys, left.count(), rkeys, right.count(), threads, result,
+			[&](std::ptrdiff_t i, std::ptrdiff_t le, std::ptrdiff_t j, std::ptrdiff_t re, std::vector<JoinPositions>& out) {
+		out.reserve((le - i) + (re - j));
+		while (i < le && j < re)
+		{
+			auto lkey = lkeys[i], rkey = rkeys[j];
+			if (lkey < rkey)
+				out.push_back({i++, JoinNoMatch});
+			else if (rkey < lkey)
+				out.push_back({JoinNoMatch, j++});
+			else
+				out.push_back({i++, j++});
+		}
+		for (; i < le; i++)
+			out.push_back({i, JoinNoMatch});
+		for (; j < re; j++)
+			out.push_back({JoinNoMatch, j});
+	});
+	return result;
+}
+
+} // Smitto::
+
+#undef OKM_PREFETCH
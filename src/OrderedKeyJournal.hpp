@@ -0,0 +1,527 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#pragma once
+
+#include "OrderedKeyMap.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Durable form of an OrderedKeyMap (POSIX): a write-ahead journal of inserts and removes and two
+// alternating snapshot files that are rewritten from the lowest modified page only.
+//
+// Directory layout:
+//   journal.<first record seq>  batches of records, a new segment is started after every snapshot
+//   snapshot.0, snapshot.1      a header page and the raw pair array; recovery takes the newest valid one
+//                               and replays the journal from its seq
+
+namespace Smitto {
+
+static inline std::uint64_t journalChecksum(const void* data, size_t size)
+{
+	std::uint64_t h = 14695981039346656037ull, word;
+	auto p = (const unsigned char*)data;
+	for (; size >= 8; size -= 8, p += 8)
+	{
+		memcpy(&word, p, 8);
+		h = (h ^ word) * 1099511628211ull;
+	}
+	for (; size; size--, p++)
+		h = (h ^ *p) * 1099511628211ull;
+	return h;
+}
+
+template <typename MAP>
+class OrderedKeyJournal
+{
+public:
+	typedef typename MAP::key_type KTYPE;
+	typedef typename MAP::mapped_type TYPE;
+	typedef typename MAP::size_type size_type;
+	typedef typename MAP::Pair Pair;
+	static_assert(MAP::trivialPairs, "the journal writes raw pairs, keys and values must be trivially copyable");
+	static_assert(!MAP::narrowKeys, "the journal writes raw pairs, offset key encodings are not supported");
+
+	struct Options
+	{
+		size_type batchRecords = 4096;  // records handed to the writer at once without commit()
+		bool fsync = true;              // fdatasync every group of batches and every snapshot
+		size_type pageSize = 4096;      // snapshot granularity, the pair array starts one page into the file
+	};
+
+	// Recovers the map from dir (creating it if needed) and starts the writer thread.
+	OrderedKeyJournal(const std::string& dir, MAP& map, const Options& options = Options());
+	~OrderedKeyJournal();
+	OrderedKeyJournal(const OrderedKeyJournal&) = delete;
+	OrderedKeyJournal& operator = (const OrderedKeyJournal&) = delete;
+
+	bool isOpen() const {return segment_ >= 0;}
+	// an I/O error stopped the writer, nothing after durableSeq() is on disk
+	bool failed() const {return failed_.load(std::memory_order_acquire);}
+
+// owner thread: changes go through the journal, the map stays readable directly
+	typename MAP::iterator insert(KTYPE key, TYPE value) {
+		auto it = map_.insert(key, value); touched(it.pos()); record(Insert, key, std::move(value)); return it;}
+	void remove(KTYPE key);
+	// hands the buffered records to the writer, they are durable once durableSeq() reaches seq()
+	void commit();
+	// Queues a snapshot of the pages changed since the previous snapshot into the same file.
+	// The owner thread copies the pair array from the lowest changed page to the end: appends cost only their pages,
+	// but the first snapshot of each file and one after a change near the beginning copy the whole map
+	// (memcpy speed, some 10-20 ms per 100 MB). With CopyMode::OnWrite the snapshot shares the buffer instead,
+	// and the owner copies it only when it writes into the shared pairs before the writer is done with them.
+	// Take snapshots at quiet points, every few seconds or millions of records, not per batch.
+	void snapshot();
+	// waits until everything committed or queued is written
+	void sync();
+	std::uint64_t seq() const {return seq_;}
+	std::uint64_t durableSeq() const {return durable_.load(std::memory_order_acquire);}
+
+	// Loads the newest valid snapshot and replays the journal after it, returns the seq reached.
+	static std::uint64_t recover(const std::string& dir, MAP& map) {Recovery r; recover(dir, map, r); return r.seq;}
+
+private:
+	enum Op : std::uint8_t {Insert, Remove};
+	struct Record
+	{
+		KTYPE key;
+		TYPE value;
+		std::uint64_t op;
+	};
+	struct BatchHeader
+	{
+		std::uint64_t magic;
+		std::uint64_t firstSeq;
+		std::uint64_t count;
+		std::uint64_t checksum;  // of the records and the fields above
+	};
+	struct SnapshotHeader
+	{
+		std::uint64_t magic;
+		std::uint64_t pairSize;
+		std::uint64_t seq;
+		std::uint64_t count;
+		std::uint64_t valid;
+		std::uint64_t checksum;  // of the fields above
+	};
+	struct Job
+	{
+		std::vector<Record> records;
+		std::uint64_t firstSeq = 0;
+		int file = -1;             // snapshot file, -1 for a batch
+		size_type offset = 0;      // of bytes in the pair array
+		std::vector<char> bytes;   // the pairs from offset
+		std::optional<MAP> image;  // or, with CopyMode::OnWrite, the map sharing its buffer
+		SnapshotHeader header;
+	};
+	struct Recovery
+	{
+		std::uint64_t seq = 0;
+		std::uint64_t snapshotSeq[2] = {0, 0};
+		int newest = -1;
+		size_type lowest = 0;      // lowest position changed by the replay
+	};
+	static constexpr std::uint64_t batchMagic = 0x4f4b4d4a524e4c31ull;     // OKMJRNL1
+	static constexpr std::uint64_t snapshotMagic = 0x4f4b4d534e415031ull;   // OKMSNAP1
+
+	void touched(size_type pos) {dirty_[0] = std::min(dirty_[0], pos); dirty_[1] = std::min(dirty_[1], pos);}
+	void record(Op op, KTYPE key, TYPE&& value) {
+		Record r{}; r.key = key; r.value = std::move(value); r.op = op;
+		buffer_.push_back(r); seq_++;
+		if (size_type(buffer_.size()) >= options_.batchRecords) commit();}
+	void push(Job&& job);
+	void run();
+	bool writeSnapshot(Job& job);
+	bool startSegment(std::uint64_t seq);
+	static std::string segmentName(const std::string& dir, std::uint64_t seq);
+	static std::string snapshotName(const std::string& dir, int file) {return dir + "/snapshot." + std::to_string(file);}
+	static std::vector<std::uint64_t> segments(const std::string& dir);
+	static bool writeAll(int fd, const void* data, size_t size, off_t offset = -1);
+	static std::uint64_t headerChecksum(const SnapshotHeader& h) {return journalChecksum(&h, offsetof(SnapshotHeader, checksum));}
+	static void recover(const std::string& dir, MAP& map, Recovery& r);
+	static void apply(MAP& map, const Record& record, Recovery& r);
+
+private:
+	const std::string dir_;
+	const Options options_;
+	MAP& map_;
+	std::vector<Record> buffer_;
+	std::uint64_t seq_ = 0;
+	size_type dirty_[2] = {0, 0};
+	int nextSnapshot_ = 0;
+	std::uint64_t jobsQueued_ = 0;
+
+	// writer thread
+	int segment_ = -1;
+	int snapshotFd_[2] = {-1, -1};
+	std::uint64_t snapshotSeq_[2] = {0, 0};
+
+	std::mutex mutex_;
+	std::condition_variable ready_;
+	std::condition_variable done_;
+	std::vector<Job> queue_;
+	std::vector<std::vector<Record>> spare_;  // written batches for reuse
+	std::uint64_t jobsDone_ = 0;
+	bool stop_ = false;
+	std::atomic<std::uint64_t> durable_{0};
+	std::atomic<bool> failed_{false};
+	std::thread writer_;
+};
+
+template <typename MAP>
+OrderedKeyJournal<MAP>::OrderedKeyJournal(const std::string& dir, MAP& map, const Options& options)
+	: dir_(dir), options_(options), map_(map)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(dir_, ec);
+	Recovery r;
+	recover(dir_, map_, r);
+	seq_ = r.seq;
+	durable_ = r.seq;
+	snapshotSeq_[0] = r.snapshotSeq[0];
+	snapshotSeq_[1] = r.snapshotSeq[1];
+	// the newest snapshot misses only the replayed changes, the other one is rewritten whole
+	nextSnapshot_ = r.newest < 0 ? 0 : 1 - r.newest;
+	if (r.newest >= 0)
+		dirty_[r.newest] = r.lowest;
+	for (int i = 0; i < 2; i++)
+		snapshotFd_[i] = ::open(snapshotName(dir_, i).c_str(), O_RDWR | O_CREAT, 0644);
+	buffer_.reserve(options_.batchRecords);
+	if (snapshotFd_[0] >= 0 && snapshotFd_[1] >= 0 && startSegment(seq_))
+		writer_ = std::thread([this]() {run();});
+}
+
+template <typename MAP>
+OrderedKeyJournal<MAP>::~OrderedKeyJournal()
+{
+	if (writer_.joinable())
+	{
+		commit();
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		ready_.notify_one();
+		writer_.join();
+	}
+	for (int fd : {segment_, snapshotFd_[0], snapshotFd_[1]})
+		if (fd >= 0)
+			::close(fd);
+}
+
+template <typename MAP>
+void OrderedKeyJournal<MAP>::remove(KTYPE key)
+{
+	auto it = std::as_const(map_).lowerBound(key);
+	if (it == map_.constEnd() || it.key() != key)
+		return;
+	touched(it.pos());
+	map_.remove(key);
+	record(Remove, key, TYPE());
+}
+
+template <typename MAP>
+void OrderedKeyJournal<MAP>::commit()
+{
+	if (buffer_.empty())
+		return;
+	Job job;
+	job.firstSeq = seq_ - buffer_.size();
+	job.records.swap(buffer_);
+	push(std::move(job));
+	if (!buffer_.capacity())
+		buffer_.reserve(options_.batchRecords);
+}
+
+template <typename MAP>
+void OrderedKeyJournal<MAP>::snapshot()
+{
+	commit();
+	Job job;
+	int file = nextSnapshot_;
+	nextSnapshot_ = 1 - file;
+	size_type count = map_.count();
+	size_type start = std::min(dirty_[file], count)*sizeof(Pair)/options_.pageSize*options_.pageSize;
+	size_type end = count*sizeof(Pair);
+	job.file = file;
+	job.offset = start;
+	if constexpr (MAP::copyMode == CopyMode::OnWrite)
+		job.image.emplace(map_);
+	else
+		job.bytes.assign((const char*)map_.data() + start, (const char*)map_.data() + end);
+	job.header = SnapshotHeader{snapshotMagic, sizeof(Pair), seq_, std::uint64_t(count), 1, 0};
+	job.header.checksum = headerChecksum(job.header);
+	dirty_[file] = count;
+	push(std::move(job));
+}
+
+template <typename MAP>
+void OrderedKeyJournal<MAP>::sync()
+{
+	commit();
+	std::unique_lock<std::mutex> lock(mutex_);
+	done_.wait(lock, [this]() {return jobsDone_ >= jobsQueued_ || failed_.load() || !writer_.joinable();});
+}
+
+template <typename MAP>
+void OrderedKeyJournal<MAP>::push(Job&& job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.push_back(std::move(job));
+		jobsQueued_++;
+		if (buffer_.empty() && !spare_.empty())
+		{
+			buffer_.swap(spare_.back());
+			spare_.pop_back();
+		}
+	}
+	ready_.notify_one();
+}
+
+// Group commit: every wake-up writes all queued batches with one fdatasync.
+template <typename MAP>
+void OrderedKeyJournal<MAP>::run()
+{
+	std::vector<Job> jobs;
+	for (;;)
+	{
+		bool stopping;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			ready_.wait(lock, [this]() {return stop_ || !queue_.empty();});
+			jobs.swap(queue_);
+			stopping = stop_ && jobs.empty();
+		}
+		if (stopping)
+			return;
+		bool ok = !failed_.load(std::memory_order_relaxed), unsynced = false;
+		std::uint64_t reached = durable_.load(std::memory_order_relaxed);
+		for (auto& job : jobs)
+		{
+			if (!ok)
+				break;
+			if (job.file >= 0)
+			{
+				if (unsynced && options_.fsync)
+					ok = fdatasync(segment_) == 0;
+				unsynced = false;
+				ok = ok && writeSnapshot(job);
+				continue;
+			}
+			BatchHeader header{batchMagic, job.firstSeq, job.records.size(), 0};
+			header.checksum = journalChecksum(job.records.data(), job.records.size()*sizeof(Record))
+					^ journalChecksum(&header, offsetof(BatchHeader, checksum));
+			ok = writeAll(segment_, &header, sizeof(header))
+					&& writeAll(segment_, job.records.data(), job.records.size()*sizeof(Record));
+			unsynced = true;
+			reached = job.firstSeq + job.records.size();
+		}
+		if (ok && unsynced && options_.fsync)
+			ok = fdatasync(segment_) == 0;
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (ok)
+			durable_.store(reached, std::memory_order_release);
+		else
+			failed_.store(true, std::memory_order_release);
+		jobsDone_ += jobs.size();
+		for (auto& job : jobs)
+			if (job.records.capacity() && spare_.size() < 4)
+			{
+				job.records.clear();
+				spare_.push_back(std::move(job.records));
+			}
+		jobs.clear();
+		done_.notify_all();
+	}
+}
+
+// The header is invalidated before the pages are overwritten, so a crash in between
+// leaves the other snapshot as the newest valid one.
+template <typename MAP>
+bool OrderedKeyJournal<MAP>::writeSnapshot(Job& job)
+{
+	int fd = snapshotFd_[job.file];
+	auto page = options_.pageSize;
+	SnapshotHeader invalid{};
+	if (!writeAll(fd, &invalid, sizeof(invalid), 0) || (options_.fsync && fdatasync(fd) != 0))
+		return false;
+	const char* bytes = job.image ? (const char*)job.image->data() + job.offset : job.bytes.data();
+	size_t size = job.image ? job.header.count*sizeof(Pair) - job.offset : job.bytes.size();
+	if (!writeAll(fd, bytes, size, page + job.offset)
+			|| ftruncate(fd, page + job.header.count*sizeof(Pair)) != 0
+			|| (options_.fsync && fdatasync(fd) != 0))
+		return false;
+	if (!writeAll(fd, &job.header, sizeof(job.header), 0) || (options_.fsync && fdatasync(fd) != 0))
+		return false;
+	snapshotSeq_[job.file] = job.header.seq;
+	if (!startSegment(job.header.seq))
+		return false;
+	// the older snapshot still needs the journal from its seq
+	auto keep = std::min(snapshotSeq_[0], snapshotSeq_[1]);
+	auto list = segments(dir_);
+	for (size_t i = 0; i + 1 < list.size(); i++)
+		if (list[i+1] <= keep)
+			::unlink(segmentName(dir_, list[i]).c_str());
+	return true;
+}
+
+template <typename MAP>
+bool OrderedKeyJournal<MAP>::startSegment(std::uint64_t seq)
+{
+	if (segment_ >= 0)
+		::close(segment_);
+	// a segment already named by this seq holds no valid records past it
+	segment_ = ::open(segmentName(dir_, seq).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	return segment_ >= 0;
+}
+
+template <typename MAP>
+std::string OrderedKeyJournal<MAP>::segmentName(const std::string& dir, std::uint64_t seq)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/journal.%020llu", (unsigned long long)seq);
+	return dir + name;
+}
+
+template <typename MAP>
+std::vector<std::uint64_t> OrderedKeyJournal<MAP>::segments(const std::string& dir)
+{
+	std::vector<std::uint64_t> res;
+	std::error_code ec;
+	for (auto& entry : std::filesystem::directory_iterator(dir, ec))
+	{
+		auto name = entry.path().filename().string();
+		if (name.rfind("journal.", 0) == 0)
+			res.push_back(std::stoull(name.substr(8)));
+	}
+	std::sort(res.begin(), res.end());
+	return res;
+}
+
+template <typename MAP>
+bool OrderedKeyJournal<MAP>::writeAll(int fd, const void* data, size_t size, off_t offset)
+{
+	auto p = (const char*)data;
+	while (size)
+	{
+		auto n = offset < 0 ? ::write(fd, p, size) : ::pwrite(fd, p, size, offset);
+		if (n < 0)
+			return false;
+		p += n;
+		size -= n;
+		if (offset >= 0)
+			offset += n;
+	}
+	return true;
+}
+
+template <typename MAP>
+void OrderedKeyJournal<MAP>::apply(MAP& map, const Record& record, Recovery& r)
+{
+	if (record.op == Insert)
+		r.lowest = std::min(r.lowest, map.insert(record.key, record.value).pos());
+	else
+	{
+		auto it = std::as_const(map).lowerBound(record.key);
+		if (it != map.constEnd() && it.key() == record.key)
+		{
+			r.lowest = std::min(r.lowest, it.pos());
+			map.remove(record.key);
+		}
+	}
+}
+
+template <typename MAP>
+void OrderedKeyJournal<MAP>::recover(const std::string& dir, MAP& map, Recovery& r)
+{
+	map.clear();
+	for (int i = 0; i < 2; i++)
+	{
+		int fd = ::open(snapshotName(dir, i).c_str(), O_RDONLY);
+		if (fd < 0)
+			continue;
+		SnapshotHeader h;
+		if (::pread(fd, &h, sizeof(h), 0) == sizeof(h) && h.magic == snapshotMagic && h.valid
+				&& h.pairSize == sizeof(Pair) && h.checksum == headerChecksum(h))
+		{
+			r.snapshotSeq[i] = h.seq;
+			if (r.newest < 0 || h.seq > r.snapshotSeq[r.newest])
+				r.newest = i;
+		}
+		::close(fd);
+	}
+	if (r.newest >= 0)
+	{
+		int fd = ::open(snapshotName(dir, r.newest).c_str(), O_RDONLY);
+		SnapshotHeader h;
+		struct stat st;
+		bool loaded = false;
+		if (fd >= 0 && ::pread(fd, &h, sizeof(h), 0) == sizeof(h) && fstat(fd, &st) == 0)
+		{
+			size_type bytes = h.count*sizeof(Pair);
+			size_type page = st.st_size - bytes;
+			loaded = !h.count;
+			if (h.count && page > 0)
+			{
+				void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (addr != MAP_FAILED)
+				{
+					madvise(addr, st.st_size, MADV_SEQUENTIAL);
+					map = MAP((const char*)addr + page, bytes);
+					munmap(addr, st.st_size);
+					loaded = true;
+				}
+			}
+		}
+		if (fd >= 0)
+			::close(fd);
+		if (loaded)
+			r.seq = h.seq;
+		else
+			r.newest = -1;
+	}
+	r.lowest = map.count();
+
+	std::vector<Record> records;
+	for (auto first : segments(dir))
+	{
+		if (first > r.seq)
+			break; // records are missing in between
+		int fd = ::open(segmentName(dir, first).c_str(), O_RDONLY);
+		if (fd < 0)
+			break;
+		BatchHeader h;
+		while (::read(fd, &h, sizeof(h)) == sizeof(h) && h.magic == batchMagic && h.firstSeq <= r.seq)
+		{
+			records.resize(h.count);
+			size_t bytes = h.count*sizeof(Record);
+			if (size_t(::read(fd, records.data(), bytes)) != bytes
+					|| h.checksum != (journalChecksum(records.data(), bytes) ^ journalChecksum(&h, offsetof(BatchHeader, checksum))))
+				break; // torn tail of a crash, the next segment continues from the last whole batch
+			for (size_t i = r.seq - h.firstSeq; i < records.size(); i++)
+				apply(map, records[i], r);
+			r.seq = std::max(r.seq, h.firstSeq + h.count);
+		}
+		::close(fd);
+	}
+}
+
+} // Smitto::
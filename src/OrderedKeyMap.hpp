@@ -5,9 +5,20 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include <memory.h>
+#include <ranges>
+#include <span>
+#include <type_traits>
 #include <utility>
+#include "OrderedKeyStats.hpp"
 
 #ifndef DWLOG
 #define DWLOG(text)
@@ -24,70 +35,143 @@ enum class FindAlgorithm
 	RelativePrediction
 };
 
+enum class CopyMode
+{
+	Deep,     // every copy duplicates the buffer
+	OnWrite   // copies share a reference-counted buffer until one of them writes
+};
+
+enum class KeyEncoding
+{
+	Full,      // pairs hold the keys
+	Offset32,  // pairs hold 32-bit offsets from keyBase(), for integer keys of one map spanning less than 2^32
+	Offset16   // pairs hold 16-bit offsets from keyBase()
+};
+
+template <typename KTYPE, KeyEncoding KEYENCODING>
+using StoredKey = std::conditional_t<KEYENCODING == KeyEncoding::Full, KTYPE,
+		std::conditional_t<KEYENCODING == KeyEncoding::Offset32, std::uint32_t, std::uint16_t>>;
+
+// Types whose objects may be moved to another address by copying their bytes.
+// Specialize it for such non-trivial types (std::vector, smart pointers...) to keep memmove for them.
+#ifdef QTYPEINFO_H
+template <typename T>
+struct IsTriviallyRelocatable : std::bool_constant<std::is_trivially_copyable_v<T> || QTypeInfo<T>::isRelocatable> {};
+#else
+template <typename T>
+struct IsTriviallyRelocatable : std::is_trivially_copyable<T> {};
+#endif
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM = FindAlgorithm::BinarySeparation>
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM = FindAlgorithm::BinarySeparation,
+		  CopyMode COPYMODE = CopyMode::Deep, StatsMode STATSMODE = StatsMode::None, KeyEncoding KEYENCODING = KeyEncoding::Full>
 class OrderedKeyMap
 {
 public:
+	// With an offset KeyEncoding Pair::key is the offset of the key from keyBase(): the pair array is narrower and
+	// searches compare narrow keys, the API still takes and returns KTYPE keys.
+	// A key that is more than the offset range away from the other keys of the map is not inserted.
+	typedef StoredKey<KTYPE, KEYENCODING> stored_key_type;
+	static constexpr bool narrowKeys = KEYENCODING != KeyEncoding::Full;
+	static_assert(!narrowKeys || (std::is_integral_v<KTYPE> && sizeof(stored_key_type) < sizeof(KTYPE)),
+			"offset key encodings need integer keys wider than the offset");
 	struct Pair
 	{
-		KTYPE key;
+		stored_key_type key;
 		TYPE value;
-		Pair(KTYPE pkey, TYPE&& pvalue) : key(pkey), value(std::move(pvalue)) {}
-		Pair(KTYPE pkey, const TYPE& pvalue) : key(pkey), value(pvalue) {}
+		Pair(stored_key_type pkey, TYPE&& pvalue) : key(pkey), value(std::move(pvalue)) {}
+		Pair(stored_key_type pkey, const TYPE& pvalue) : key(pkey), value(pvalue) {}
+		template <typename... Args>
+		Pair(std::in_place_t, stored_key_type pkey, Args&&... args) : key(pkey), value(std::forward<Args>(args)...) {}
 	};
-	struct iterator
+	typedef KTYPE key_type;
+	typedef TYPE mapped_type;
+	typedef std::ptrdiff_t size_type;
+	static constexpr CopyMode copyMode = COPYMODE;
+	// pairs are copied with memcpy, moved with memmove and compared with memcmp where the types allow it
+	static constexpr bool trivialPairs = std::is_trivially_copyable_v<Pair>;
+	static constexpr bool relocatablePairs = trivialPairs || IsTriviallyRelocatable<TYPE>::value;
+	static_assert(std::is_trivially_copyable_v<KTYPE>, "keys must be trivially copyable, only values may be non-trivial");
+	static_assert(COPYMODE == CopyMode::Deep || trivialPairs, "CopyMode::OnWrite needs trivially copyable keys and values");
+	// Random access iterator over values that walks the pair array by pointer, an append that reallocates invalidates it.
+	// The const overloads hand out const_iterator, which gives read-only access to the values.
+	// For contiguous access to the pairs use pairs(), for key and value projections keysView() and valuesView().
+	template <bool READONLY>
+	struct PairIterator
 	{
-		iterator() : container_(nullptr), pos_(0) {}
-		iterator(const OrderedKeyMap* container, int ppos) : container_(container), pos_(ppos) {}
-		inline KTYPE key() const {if (pos_ >= container_->size() || pos_ < 0) return -1; return container_->dataAt(pos_).key;}
-		inline TYPE& value() {return container_->dataAt(pos_).value;}
-		inline TYPE value() const {return container_->dataAt(pos_).value;}
-		inline int pos() const {return pos_;}
-		inline bool operator != (const iterator& other) const {return pos_ != other.pos_;}
-		inline bool operator == (const iterator& other) const {return pos_ == other.pos_;}
-		inline iterator& operator ++ () {pos_++; return *this;}
-		inline iterator operator++(int) {iterator r = *this; pos_++; return r;}
-		inline iterator& operator -- () {pos_--; return *this;}
-		inline iterator operator --(int) {iterator r = *this; pos_--; return r;}
-		inline iterator operator + (int n) const {return iterator(container_, pos_+n);}
-		inline iterator operator - (int n) const {return iterator(container_, pos_-n);}
-		inline TYPE& operator*() {return value();}
-		inline TYPE* operator->() {return &value();}
-		inline operator bool() const  {return pos_ >= 0 && pos_ < container_->count();}
-		bool isEnd() const {return pos_ == container_->count();}
+		typedef std::conditional_t<READONLY, const Pair, Pair> PairType;
+		typedef std::random_access_iterator_tag iterator_category;
+		typedef std::random_access_iterator_tag iterator_concept;
+		typedef TYPE value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef std::conditional_t<READONLY, const TYPE, TYPE>* pointer;
+		typedef std::conditional_t<READONLY, const TYPE, TYPE>& reference;
+
+		PairIterator() = default;
+		PairIterator(const OrderedKeyMap* container, size_type ppos) : container_(container), ptr_(container->data_+ppos) {}
+		template <bool R> requires (READONLY && !R)
+		PairIterator(const PairIterator<R>& o) : container_(o.container_), ptr_(o.ptr_) {}
+		inline KTYPE key() const {if (ptr_ >= container_->data_+container_->count_ || ptr_ < container_->data_) return -1;
+			return container_->decodeKey(ptr_->key);}
+		inline reference value() const {return ptr_->value;}
+		inline PairType& pair() const {return *ptr_;}
+		inline size_type pos() const {return ptr_ - container_->data_;}
+		template <bool R> inline bool operator == (const PairIterator<R>& other) const {return ptr_ == other.ptr_;}
+		template <bool R> inline auto operator <=> (const PairIterator<R>& other) const {return ptr_ <=> other.ptr_;}
+		inline PairIterator& operator ++ () {ptr_++; return *this;}
+		inline PairIterator operator++(int) {PairIterator r = *this; ptr_++; return r;}
+		inline PairIterator& operator -- () {ptr_--; return *this;}
+		inline PairIterator operator --(int) {PairIterator r = *this; ptr_--; return r;}
+		inline PairIterator& operator += (difference_type n) {ptr_ += n; return *this;}
+		inline PairIterator& operator -= (difference_type n) {ptr_ -= n; return *this;}
+		inline PairIterator operator + (difference_type n) const {PairIterator r = *this; return r += n;}
+		inline PairIterator operator - (difference_type n) const {PairIterator r = *this; return r -= n;}
+		friend inline PairIterator operator + (difference_type n, const PairIterator& it) {return it + n;}
+		template <bool R> inline difference_type operator - (const PairIterator<R>& other) const {return ptr_ - other.ptr_;}
+		inline reference operator[](difference_type n) const {return ptr_[n].value;}
+		inline reference operator*() const {return ptr_->value;}
+		inline pointer operator->() const {return &ptr_->value;}
+		inline explicit operator bool() const {return ptr_ >= container_->data_ && ptr_ < container_->data_+container_->count_;}
+		bool isEnd() const {return ptr_ == container_->data_+container_->count_;}
 	private:
+		template <bool> friend struct PairIterator;
 		const OrderedKeyMap* container_ = nullptr;
-		int pos_ = 0;
+		PairType* ptr_ = nullptr;
 	};
+	typedef PairIterator<false> iterator;
+	typedef PairIterator<true> const_iterator;
 
 // standard
 	inline TYPE operator [](KTYPE key) const {auto it = find(key); if (it != constEnd()) return it.value();
+		stats_.miss();
 		DWLOG(name + QString(" OKM: Miss - key %1. Range %2-%3 count %4").arg(key).arg(firstKey_).arg(lastKey_).arg(count_));
 		return emptyVal;}
 	TYPE& operator [](KTYPE key);
-	inline TYPE value(KTYPE key) const {return const_cast<OrderedKeyMap*>(this)->operator[] (key);}
-	inline TYPE& first() {if (count_) return (*(Pair*)((char*)data_)).value;
-		DWLOG(name + " OKM: Miss - first"); return emptyVal;}
-	inline TYPE first() const {return const_cast<OrderedKeyMap*>(this)->first(); }
-	inline TYPE& last() {if (count_) return (*(Pair*)((char*)data_+(count_-1)*sizeof(Pair))).value;
-		DWLOG(name + " OKM: Miss - last"); return emptyVal;}
-	inline TYPE last() const {return const_cast<OrderedKeyMap*>(this)->last();}
+	inline TYPE value(KTYPE key) const {return operator[] (key);}
+	inline TYPE& first() {if (count_) {detachShared(); return data_[0].value;}
+		stats_.miss(); DWLOG(name + " OKM: Miss - first"); return emptyVal;}
+	inline TYPE first() const {if (count_) return data_[0].value; stats_.miss(); return emptyVal;}
+	inline TYPE& last() {if (count_) {detachShared(); return data_[count_-1].value;}
+		stats_.miss(); DWLOG(name + " OKM: Miss - last"); return emptyVal;}
+	inline TYPE last() const {if (count_) return data_[count_-1].value; stats_.miss(); return emptyVal;}
 	inline KTYPE lastKey() const {return lastKey_;}
 	inline KTYPE firstKey() const {return firstKey_;}
 	inline bool contains(KTYPE key) const { return constFind(key) != constEnd(); }
-	inline int count() const {return count_;}
-	inline int size() const {return count_;}
+	inline size_type count() const {return count_;}
+	inline size_type size() const {return count_;}
 	inline bool isEmpty() const {return !count_;}
 	inline bool empty() const {return isEmpty();}
 	iterator insert(KTYPE key, TYPE value);
 	void remove(KTYPE key);
-	inline void clear() {count_ = 0; lastKey_ = 0; firstKey_ = 0;}
+	inline void clear() {destroyPairs(data_, count_); count_ = 0; lastKey_ = 0; firstKey_ = 0;}
 
 // additional
-	TYPE& valueNearPos(KTYPE key, int pos);
-	TYPE valueNearPos(KTYPE key, int pos) const {return const_cast<OrderedKeyMap*>(this)->valueNearPos(key, pos);}
-	inline Pair& dataAt(int pos) const {return *(Pair*)((char*)data_+pos*sizeof(Pair));}
+	TYPE& valueNearPos(KTYPE key, size_type pos);
+	TYPE valueNearPos(KTYPE key, size_type pos) const {auto p = nearPos(key, pos); return p < 0 ? emptyVal : dataAt(p).value;}
+	inline Pair& dataAt(size_type pos) {detachShared(); return data_[pos];}
+	inline const Pair& dataAt(size_type pos) const {return data_[pos];}
+	inline KTYPE keyAt(size_type pos) const {return decodeKey(data_[pos].key);}
+	// offset keys only, Pair::key + keyBase() is the key
+	inline KTYPE keyBase() const {return keyBase_;}
 	bool equal(const OrderedKeyMap& other) const;
 #ifdef QMAP_H
 	bool equal(const QMap<KTYPE, TYPE>& other) const;
@@ -101,122 +185,256 @@ public:
 	QPair<KTYPE, KTYPE> interval() const {return qMakePair(firstKey_, lastKey_);}
 #endif
 
-	void trimAfter(KTYPE key) {auto it = lowerBound(key); if (it == constBegin()) return; count_ = it.pos()+1; lastKey_ = it.key();}
+	void trimAfter(KTYPE key) {auto it = std::as_const(*this).lowerBound(key); if (it == constBegin() || it == constEnd()) return;
+		destroyPairs(data_+it.pos()+1, count_-it.pos()-1); count_ = it.pos()+1; lastKey_ = it.key();}
 
 // iterators
 	typedef iterator Iterator;
-	typedef iterator ConstIterator;
-	inline iterator begin() const {return constBegin();}
-	inline iterator end() const {return constEnd();}
-	inline iterator at(int pos) const {return iterator(this, pos < count_ ? pos : count_);}
-	inline iterator constBegin() const {return iterator(this, 0);}
-	inline iterator constEnd() const {return iterator(this, count_);}
-	iterator find(KTYPE key);
-	iterator findAlt(KTYPE key);
-	inline iterator find (KTYPE key) const {return const_cast<OrderedKeyMap*>(this)->find(key);}
-	inline iterator constFind (KTYPE key) const {return find(key);}
-	iterator lowerBound(KTYPE key) const;
-	iterator upperBound(KTYPE key) const {auto it = lowerBound(key); if (constEnd() == it || key < it.key()) return it; return ++it;}
-	iterator upperBoundAlt(KTYPE key) const;
+	typedef const_iterator ConstIterator;
+	inline iterator begin() {return mutableIterator(constBegin());}
+	inline iterator end() {return mutableIterator(constEnd());}
+	inline const_iterator begin() const {return constBegin();}
+	inline const_iterator end() const {return constEnd();}
+	inline iterator at(size_type pos) {return mutableIterator(std::as_const(*this).at(pos));}
+	inline const_iterator at(size_type pos) const {return const_iterator(this, pos < count_ ? pos : count_);}
+	inline const_iterator constBegin() const {return const_iterator(this, 0);}
+	inline const_iterator constEnd() const {return const_iterator(this, count_);}
+	inline iterator find(KTYPE key) {return mutableIterator(constFind(key));}
+	const_iterator find(KTYPE key) const;
+	inline const_iterator constFind (KTYPE key) const {return find(key);}
+	const_iterator findAlt(KTYPE key) const;
+	inline iterator lowerBound(KTYPE key) {return mutableIterator(std::as_const(*this).lowerBound(key));}
+	const_iterator lowerBound(KTYPE key) const;
+	inline iterator upperBound(KTYPE key) {return mutableIterator(std::as_const(*this).upperBound(key));}
+	const_iterator upperBound(KTYPE key) const {auto it = lowerBound(key); if (constEnd() == it || key < it.key()) return it; return ++it;}
+	const_iterator upperBoundAlt(KTYPE key) const;
+
+// ranges
+	// Pairs as a contiguous range, its iterators are plain pointers.
+	std::span<Pair> pairs() {detachShared(); return std::span<Pair>(data_, count_);}
+	std::span<const Pair> pairs() const {return std::span<const Pair>(data_, count_);}
+	std::span<const Pair> constPairs() const {return pairs();}
+	auto keysView() const {
+		if constexpr (narrowKeys) return std::views::transform(pairs(), [this](const Pair& pair) {return decodeKey(pair.key);});
+		else return std::views::transform(pairs(), &Pair::key);}
+	auto valuesView() {return std::views::transform(pairs(), &Pair::value);}
+	auto valuesView() const {return std::views::transform(pairs(), &Pair::value);}
 
 // constructors
-	OrderedKeyMap(int size = BASESIZE) {if (size > 0) reserveData(size*sizeof(Pair));}
+	OrderedKeyMap(size_type size = BASESIZE) {if (size > 0) reserveData(size*sizeof(Pair));}
 	OrderedKeyMap(const OrderedKeyMap& o) {
-		reserveData(o.dataSize_); memcpy(data_, o.data_, dataSize_); count_ = o.count_;
-		lastKey_ = o.lastKey_; firstKey_ = o.firstKey_; }
+		if constexpr (COPYMODE == CopyMode::OnWrite) share(o);
+		else {reserveData(std::max<size_type>(o.dataSize_, o.count_*sizeof(Pair))); copyPairs(data_, o.data_, o.count_);}
+		count_ = o.count_; lastKey_ = o.lastKey_; firstKey_ = o.firstKey_; keyBase_ = o.keyBase_; }
 	OrderedKeyMap(OrderedKeyMap&& o) noexcept {
 		dataSize_= o.dataSize_; data_ = o.data_; lastKey_ = o.lastKey_; firstKey_ = o.firstKey_; count_ = o.count_;
-		o.data_ = nullptr; o.dataSize_ = 0; o.lastKey_ = 0; o.firstKey_ = 0; o.count_ = 0; }
-	OrderedKeyMap(const void* data, int dataSize) {
+		keyBase_ = o.keyBase_; o.data_ = nullptr; o.dataSize_ = 0; o.lastKey_ = 0; o.firstKey_ = 0; o.count_ = 0; }
+	OrderedKeyMap(const void* data, size_type dataSize) requires (!narrowKeys) {
+		static_assert(trivialPairs, "raw data needs trivially copyable keys and values");
 		reserveData(dataSize); memcpy(data_, data, dataSize_ = dataSize); count_ = dataSize/sizeof(Pair);
 		if (count_) {firstKey_ = at(0).key(); lastKey_ = at(count_-1).key();} }
 	~OrderedKeyMap() {dealoc();}
 
 
-	static OrderedKeyMap fromRawData(const void* data, int dataSize) { OrderedKeyMap res(0);
-		res.dataSize_ = 0; res.data_ = const_cast<void*>(data); res.count_ = dataSize/sizeof(Pair);
+	static OrderedKeyMap fromRawData(const void* data, size_type dataSize) requires (!narrowKeys) {
+		static_assert(trivialPairs, "raw data needs trivially copyable keys and values");
+		OrderedKeyMap res(0);
+		res.dataSize_ = 0; res.data_ = (Pair*)data; res.count_ = dataSize/sizeof(Pair);
 		if (res.count_) {res.firstKey_ = res.at(0).key(); res.lastKey_ = res.at(res.count_-1).key();} return res;}
 
 // operators
 	OrderedKeyMap& operator = (OrderedKeyMap&& o) noexcept {
 		dealoc(); dataSize_= o.dataSize_; data_ = o.data_;
-		lastKey_ = o.lastKey_; firstKey_ = o.firstKey_;  count_ = o.count_;
+		lastKey_ = o.lastKey_; firstKey_ = o.firstKey_;  count_ = o.count_; keyBase_ = o.keyBase_;
 		o.data_ = nullptr; o.dataSize_ = 0; o.lastKey_ = 0; o.firstKey_ = 0; o.count_ = 0; return *this;}
 	OrderedKeyMap& operator = (const OrderedKeyMap& o) {
-		if (dataSize_ < o.dataSize_)  {dealoc(); reserveData(o.dataSize_); }
-		memcpy(data_, o.data_, o.dataSize_); count_ = o.count_;
-		lastKey_ = o.lastKey_; firstKey_ = o.firstKey_; return *this;}
+		if (this == &o) return *this;
+		if constexpr (COPYMODE == CopyMode::OnWrite) {dealoc(); share(o);}
+		else {
+			clear();
+			size_type need = o.count_*sizeof(Pair);
+			if (dataSize_ < need) {dealoc(); reserveData(std::max(o.dataSize_, need));}
+			copyPairs(data_, o.data_, o.count_);
+		}
+		count_ = o.count_; lastKey_ = o.lastKey_; firstKey_ = o.firstKey_; keyBase_ = o.keyBase_; return *this;}
 	inline bool operator == (const OrderedKeyMap& o) const {return count_ == o.count_
 				&& firstKey_ == o.firstKey_ && lastKey_ == o.lastKey_
-				&& memcmp(data_, o.data_, count_*sizeof(Pair)) == 0;}
+				&& (data_ == o.data_ || (keyBase_ == o.keyBase_ ? equalPairs(data_, o.data_, count_) : equalRebased(o)));}
 
 
-	OrderedKeyMap mid(KTYPE from, KTYPE to, int reserve = 0) const {
+	OrderedKeyMap mid(KTYPE from, KTYPE to, size_type reserve = 0) const {
 		auto itStart = lowerBound(from);
 		auto itEnd = lowerBound(to);
 		if (itStart == end() || itEnd.pos() < itStart.pos())
 			return OrderedKeyMap(0);
 		if (itEnd == end())
 			--itEnd;
-		int count = itEnd.pos() - itStart.pos()+1;
+		size_type count = itEnd.pos() - itStart.pos()+1;
 		OrderedKeyMap res(count+reserve);
-		memcpy(res.data_, (char*)data_+itStart.pos()*sizeof(Pair), count*sizeof(Pair));
+		res.keyBase_ = keyBase_;
+		copyPairs(res.data_, data_+itStart.pos(), count);
 		res.firstKey_ = itStart.key();
 		res.lastKey_ = itEnd.key();
 		res.count_ = count;
 		return res;
 	}
-	bool insertAtBegining(const OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>& other);
-	bool insertAfterEnd(const OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>& other);
+	bool insertAtBegining(const OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>& other);
+	bool insertAfterEnd(const OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>& other);
+
+// bulk append: keys must be strictly increasing and greater than lastKey(), otherwise nothing is appended
+	bool appendBulk(const KTYPE* keys, const TYPE* values, size_type n);
+	template <typename RANGE> bool appendBulk(const RANGE& pairs);
+	template <typename... Args> iterator emplace(KTYPE key, Args&&... args);
 
 #ifdef QSTRING_H
 	QString name;
-	OrderedKeyMap(const QString& nameArg, int size = BASESIZE) : OrderedKeyMap(size) {name = nameArg;}
+	OrderedKeyMap(const QString& nameArg, size_type size = BASESIZE) : OrderedKeyMap(size) {name = nameArg;}
 #endif
 #ifdef QBYTEARRAY_H
-	explicit OrderedKeyMap(const QByteArray& ba) : OrderedKeyMap(ba.data(), ba.size()) {}
-	QByteArray toRawDataByteArray() const {return QByteArray::fromRawData((const char*)data(), dataSize());}
+	explicit OrderedKeyMap(const QByteArray& ba) requires (!narrowKeys) : OrderedKeyMap(ba.data(), ba.size()) {}
+	QByteArray toRawDataByteArray() const requires (!narrowKeys) {return QByteArray::fromRawData((const char*)data(), dataSize());}
 #endif
-	int dataSize() const {return count_*sizeof(Pair);}
-	const void* data() const {return data_;}
-	void reserve(int k) {if (k*int(sizeof(Pair)) > dataSize_) realoc(k-dataSize_/sizeof(Pair));}
+	size_type dataSize() const {return count_*sizeof(Pair);}
+	// the pair array as raw data, not available with offset keys since it does not hold the keys
+	const void* data() const requires (!narrowKeys) {return data_;}
+	void reserve(size_type k) {if (k*size_type(sizeof(Pair)) > dataSize_) realoc(k*sizeof(Pair)-dataSize_);}
+
+// copy-on-write
+	bool isDetached() const {return COPYMODE == CopyMode::Deep || !dataSize_ || header()->refs.load() == 1;}
+	bool isSharedWith(const OrderedKeyMap& o) const {return dataSize_ && data_ == o.data_;}
+	// The non-const accessors (begin, end, at, find, lowerBound, upperBound, dataAt, pairs...) detach a shared map,
+	// iterate a shared map through the const overloads to keep the buffer shared.
+	void detach() {detachShared();}
+
+// statistics, all zero with StatsMode::None
+	OrderedKeyMapStats stats() const {return stats_.snapshot();}
 
 private:
-	void reserveData(int k) {if (k > 0) data_ = malloc(dataSize_ = k);}
-	void realoc(int addk) {void *ldata = data_; reserveData(dataSize_+addk); memcpy(data_, ldata, dataSize_-addk); free(ldata);}
-	void dealoc() {clear(); if (data_ && dataSize_) free(data_); data_ = nullptr; dataSize_ = 0;}
-	TYPE& insertBefore(int pos, KTYPE key, TYPE&& value);
+	// Header of a CopyMode::OnWrite buffer; it is placed right before data_.
+	// used is the high-water mark of constructed pairs, the map whose count_ equals it owns the tail.
+	struct alignas(std::max_align_t) SharedHeader
+	{
+		std::atomic<int> refs;
+		std::atomic<size_type> used;
+	};
+	static constexpr int headerSize = COPYMODE == CopyMode::OnWrite
+			? (sizeof(SharedHeader) + alignof(Pair) - 1) / alignof(Pair) * alignof(Pair) : 0;
+	SharedHeader* header() const {return (SharedHeader*)((char*)data_ - headerSize);}
+
+	void reserveData(size_type k) {if (k > 0) {data_ = (Pair*)allocData(dataSize_ = k); stats_.capacity(k);}}
+	// addk == 0 only copies a shared buffer
+	void realoc(size_type addk) {if (addk) stats_.realoc(); else stats_.detach(); Pair *ldata = data_; size_type lsize = dataSize_; reserveData(dataSize_+addk);
+		relocatePairs(data_, ldata, count_);
+		freeData(ldata, lsize);}
+	void dealoc() {clear(); freeData(data_, dataSize_); data_ = nullptr; dataSize_ = 0;}
+	static void* allocData(size_type k) {
+		if constexpr (COPYMODE == CopyMode::Deep) return malloc(k);
+		char* block = (char*)malloc(headerSize + k);
+		new (block) SharedHeader{{1}, {0}};
+		return block + headerSize;}
+	static void freeData(void* data, size_type size) {
+		if (!data || !size) return;
+		if constexpr (COPYMODE == CopyMode::OnWrite) {
+			auto h = (SharedHeader*)((char*)data - headerSize);
+			if (h->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+			data = h;
+		}
+		free(data);}
+	void share(const OrderedKeyMap& o) {
+		data_ = o.data_; dataSize_ = o.dataSize_;
+		if (!dataSize_) return; // raw data is not owned, just point at it
+		if (header()->refs.load(std::memory_order_acquire) == 1) header()->used.store(o.count_);
+		header()->refs.fetch_add(1, std::memory_order_relaxed);}
+	// before any write except appending
+	void detachShared() {
+		if constexpr (COPYMODE == CopyMode::OnWrite) if (!isDetached()) realoc(0);}
+	// before appending n pairs: an in-place append is allowed for the single owner of the tail
+	void detachForAppend(size_type n) {
+		if constexpr (COPYMODE == CopyMode::OnWrite) {
+			if (isDetached() || (count_+n)*size_type(sizeof(Pair)) > dataSize_) return; // growing detaches anyway
+			size_type used = count_;
+			if (!header()->used.compare_exchange_strong(used, count_+n))
+				realoc(0);
+		}}
+	static void copyPairs(Pair* to, const Pair* from, size_type n) {
+		if constexpr (trivialPairs) {if (n > 0) memcpy(to, from, n*sizeof(Pair));}
+		else std::uninitialized_copy_n(from, n, to);}
+	// moves pairs to uninitialized memory not overlapping them, the source is left unconstructed
+	static void relocatePairs(Pair* to, Pair* from, size_type n) {
+		if constexpr (relocatablePairs) {if (n > 0) memcpy((void*)to, (const void*)from, n*sizeof(Pair));}
+		else {std::uninitialized_move_n(from, n, to); std::destroy_n(from, n);}}
+	static void destroyPairs(Pair* from, size_type n) {
+		if constexpr (!std::is_trivially_destructible_v<Pair>) if (n > 0) std::destroy_n(from, n);}
+	// float and double compare bitwise like the types with unique representations, so a copy of a NaN equals its source
+	template <typename T> static constexpr bool bitwiseEqual = std::has_unique_object_representations_v<T>
+			|| std::is_same_v<T, float> || std::is_same_v<T, double>;
+	template <typename T> static bool equalMembers(const T& a, const T& b) {
+		if constexpr (bitwiseEqual<T>) return memcmp(&a, &b, sizeof(T)) == 0; else return a == b;}
+	static bool equalPairs(const Pair* a, const Pair* b, size_type n) {
+		if constexpr (bitwiseEqual<stored_key_type> && bitwiseEqual<TYPE> && sizeof(Pair) == sizeof(stored_key_type) + sizeof(TYPE))
+			return n <= 0 || memcmp(a, b, n*sizeof(Pair)) == 0;
+		for (size_type i = 0; i < n; i++)
+			if (!equalMembers(a[i].key, b[i].key) || !equalMembers(a[i].value, b[i].value))
+				return false;
+		return true;}
+	size_type nearPos(KTYPE key, size_type pos) const;
+	inline KTYPE decodeKey(stored_key_type key) const {if constexpr (narrowKeys) return keyBase_ + KTYPE(key); else return key;}
+	inline stored_key_type encodeKey(KTYPE key) const {if constexpr (narrowKeys) return stored_key_type(key - keyBase_); else return key;}
+	bool encodable(KTYPE key);
+	bool encodable(KTYPE first, KTYPE last);
+	bool equalRebased(const OrderedKeyMap& o) const;
+	// pairs of another map, re-encoded when its key base differs
+	void copyPairsFrom(Pair* to, const OrderedKeyMap& o) {
+		if (!narrowKeys || keyBase_ == o.keyBase_) {copyPairs(to, o.data_, o.count_); return;}
+		for (size_type i = 0; i < o.count_; i++)
+			new (to+i) Pair(encodeKey(o.keyAt(i)), o.data_[i].value);}
+	// positions survive the detach, pointers do not
+	iterator mutableIterator(const_iterator it) {size_type pos = it.pos(); detachShared(); return iterator(this, pos);}
+	// one capacity check before appending n pairs
+	void growFor(size_type n) {
+		detachForAppend(n);
+		size_type need = (count_+n)*sizeof(Pair);
+		if (need > dataSize_)
+			realoc(std::max(need, dataSize_ ? 2*dataSize_ : size_type(BASESIZE*sizeof(Pair))) - dataSize_);}
+	TYPE& insertBefore(size_type pos, KTYPE key, TYPE&& value);
 
 private:
-	int dataSize_ = 0;
-	void* data_ = nullptr;
-	int count_ = 0;
+	size_type dataSize_ = 0;
+	Pair* data_ = nullptr;
+	size_type count_ = 0;
 	KTYPE lastKey_ = 0;
 	KTYPE firstKey_ = 0;
+	KTYPE keyBase_ = 0; // offset keys only
 	TYPE emptyVal = TYPE(); // 0
+	[[no_unique_address]] OrderedKeyMapCounters<STATSMODE> stats_;
 };
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::insert(KTYPE key, TYPE value)
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::insert(KTYPE key, TYPE value)
 {
+	if (!encodable(key))
+		return iterator(this, count_);
 	if (!dataSize_)
 		reserveData(BASESIZE*sizeof(Pair));
 	if (empty())
 	{
-		new ((Pair*)((char*)data_)) Pair(key, std::move(value));
+		detachForAppend(1);
+		new (data_) Pair(encodeKey(key), std::move(value));
 		count_++;
 		firstKey_ = key;
 		lastKey_ = key;
-		return constBegin();
+		return iterator(this, 0);
 	}
 	if (key > lastKey_)
 	{
-		if (int((count_+1)*sizeof(Pair)) > dataSize_)
+		detachForAppend(1);
+		if (size_type((count_+1)*sizeof(Pair)) > dataSize_)
 			realoc(dataSize_);
-		new ((Pair*)((char*)data_+count_*sizeof(Pair))) Pair(key, std::move(value));
+		new (data_+count_) Pair(encodeKey(key), std::move(value));
 		lastKey_ = key;
 		return iterator(this, count_++);
 	}
+	detachShared();
 	auto it = lowerBound(key);
 	if (it.key() == key)
 	{
@@ -226,69 +444,87 @@ typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::iterator OrderedKeyMap<KTYPE
 			DWLOG(name + QString(" OKM: Вставка в середину %1 из %2").arg(it.pos()).arg(count_));
 		}
 #endif
-		((Pair*)((char*)data_+it.pos()*sizeof(Pair)))->value = value;
+		it.value() = std::move(value);
 		return it;
 	}
-	insertBefore(it.pos(), key, std::move(value));
-	return it;
+	auto pos = it.pos();
+	insertBefore(pos, key, std::move(value));
+	return iterator(this, pos);
 }
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-TYPE& OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::insertBefore(int pos, KTYPE key, TYPE&& value)
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+TYPE& OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::insertBefore(size_type pos, KTYPE key, TYPE&& value)
 {
-	if (int((count_+1)*sizeof(Pair)) > dataSize_)
+	stats_.middleInsert((count_-pos)*sizeof(Pair));
+	if (size_type((count_+1)*sizeof(Pair)) > dataSize_)
 	{
-		void *ldata = data_;
+		stats_.realoc();
+		Pair *ldata = data_;
+		size_type lsize = dataSize_;
 		reserveData(2*dataSize_);
-		if (pos > 0)
-			memcpy((char*)data_, ldata, pos*sizeof(Pair));
+		relocatePairs(data_, ldata, pos);
 		DWLOG(name + (pos > 0 ? QString("OKM: Inserting element %1 in the middle and increasing the size").arg(key) :
 							 QString("Inserting element %1 at the beginning and increasing the size").arg(key)));
-		memcpy((char*)data_+(pos+1)*sizeof(Pair), (char*)ldata+(pos)*sizeof(Pair),
-			   (count_ - pos)*sizeof(Pair));
-		free(ldata);
+		relocatePairs(data_+pos+1, ldata+pos, count_ - pos);
+		freeData(ldata, lsize);
+		new (data_+pos) Pair(encodeKey(key), std::move(value));
 	}
 	else
 	{
+		detachShared();
 		DWLOG(name + (pos > 0 ? QString("OKM: Inserting element %1 in the middle is highly discouraged").arg(key) :
 							 QString("Inserting element %1 at the beginning is highly discouraged").arg(key)));
-		memmove((char*)data_+(pos+1)*sizeof(Pair), (char*)data_+(pos)*sizeof(Pair),
-				(count_-pos)*sizeof(Pair));
+		if constexpr (relocatablePairs)
+		{
+			memmove((void*)(data_+pos+1), (const void*)(data_+pos), (count_-pos)*sizeof(Pair));
+			new (data_+pos) Pair(encodeKey(key), std::move(value));
+		}
+		else
+		{
+			new (data_+count_) Pair(std::move(data_[count_-1]));
+			std::move_backward(data_+pos, data_+count_-1, data_+count_);
+			data_[pos] = Pair(encodeKey(key), std::move(value));
+		}
 	}
-	Pair* pair = (Pair*)((char*)data_+pos*sizeof(Pair));
-	*pair = Pair(key, std::move(value));
+	Pair* pair = data_+pos;
 	if (pos == 0)
 		firstKey_ = key;
 	count_++;
 	return pair->value;
 }
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::insertAtBegining(const OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>& other)
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::insertAtBegining(const OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>& other)
 {
 	if (other.lastKey() >= firstKey())
 		return false;
-	void *ldata = data_;
+	if (!other.empty() && !encodable(other.firstKey_, other.lastKey_))
+		return false;
+	Pair *ldata = data_;
+	size_type lsize = dataSize_;
 	reserveData((other.count_ + count_ + BASESIZE)*sizeof(Pair));
-	memcpy((char*)data_, other.data_, other.count_*sizeof(Pair));
+	copyPairsFrom(data_, other);
 	if (empty())
 		lastKey_ = other.lastKey_;
 	else
-		memcpy((char*)data_+other.count_*sizeof(Pair), ldata, count_*sizeof(Pair));
+		relocatePairs(data_+other.count_, ldata, count_);
 	count_ = other.count_ + count_;
 	firstKey_ = other.firstKey_;
-	free(ldata);
+	freeData(ldata, lsize);
 	return true;
 }
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::insertAfterEnd(const OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>& other)
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::insertAfterEnd(const OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>& other)
 {
 	if (other.firstKey() <= lastKey())
 		return false;
-	if ((other.count_ + count_)*int(sizeof(Pair)) > dataSize_)
+	if (!other.empty() && !encodable(other.firstKey_, other.lastKey_))
+		return false;
+	detachForAppend(other.count_);
+	if ((other.count_ + count_)*size_type(sizeof(Pair)) > dataSize_)
 		realoc((other.count_ + count_ + BASESIZE)*sizeof(Pair));
-	memcpy((char*)data_+count_*sizeof(Pair), other.data_, other.count_*sizeof(Pair));
+	copyPairsFrom(data_+count_, other);
 	if (empty())
 		firstKey_ = other.firstKey_;
 	count_ = other.count_ + count_;
@@ -296,13 +532,82 @@ bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::insertAfterEnd(const OrderedKeyM
 	return true;
 }
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-void OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::remove(KTYPE key)
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::appendBulk(const KTYPE* keys, const TYPE* values, size_type n)
+{
+	if (n <= 0)
+		return true;
+	bool ordered = empty() || keys[0] > lastKey_;
+	for (size_type i = 1; i < n; i++)
+		ordered &= keys[i] > keys[i-1];
+	if (!ordered || !encodable(keys[0], keys[n-1]))
+		return false;
+	growFor(n);
+	Pair* pairs = data_+count_;
+	for (size_type i = 0; i < n; i++)
+		new (pairs+i) Pair(encodeKey(keys[i]), values[i]);
+	if (empty())
+		firstKey_ = keys[0];
+	lastKey_ = keys[n-1];
+	count_ += n;
+	return true;
+}
+
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+template <typename RANGE>
+bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::appendBulk(const RANGE& pairs)
 {
+	size_type n = std::ranges::distance(pairs);
+	if (n <= 0)
+		return true;
+	const auto& [lowest, lowestValue] = *std::ranges::begin(pairs);
+	bool ordered = true, first = empty();
+	KTYPE prev = lastKey_;
+	for (const auto& [key, value] : pairs)
+	{
+		ordered &= first || key > prev;
+		first = false;
+		prev = key;
+	}
+	if (!ordered || !encodable(lowest, prev))
+		return false;
+	growFor(n);
+	Pair* pair = data_+count_;
+	for (const auto& [key, value] : pairs)
+		new (pair++) Pair(encodeKey(key), value);
+	if (empty())
+		firstKey_ = lowest;
+	lastKey_ = prev;
+	count_ += n;
+	return true;
+}
+
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+template <typename... Args>
+typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::emplace(KTYPE key, Args&&... args)
+{
+	if (!empty() && key <= lastKey_)
+		return insert(key, TYPE(std::forward<Args>(args)...));
+	if (!encodable(key))
+		return iterator(this, count_);
+	growFor(1);
+	new (data_+count_) Pair(std::in_place, encodeKey(key), std::forward<Args>(args)...);
+	if (empty())
+		firstKey_ = key;
+	lastKey_ = key;
+	return iterator(this, count_++);
+}
+
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+void OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::remove(KTYPE key)
+{
+	if (empty())
+		return;
 	if (key == lastKey_)
 	{
-		if (--count_)
-			lastKey_ = dataAt(count_ - 1).key;
+		destroyPairs(data_ + --count_, 1);
+		if (count_)
+			lastKey_ = keyAt(count_ - 1);
 		else
 		{
 			lastKey_ = 0;
@@ -311,30 +616,102 @@ void OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::remove(KTYPE key)
 		return;
 	}
 	DWLOG(name + QString("OKM: Removing element of element %1 from the middle is highly discouraged").arg(key));
-	auto it = lowerBound(key);
-	if (it == constEnd())
+	auto it = std::as_const(*this).lowerBound(key);
+	if (it == constEnd() || it.key() != key)
 		return;
-	memmove((char*)data_+(it.pos()-1)*sizeof(Pair), (char*)data_+(it.pos())*sizeof(Pair), count_-it.pos());
+	auto pos = it.pos();
+	detachShared();
+	stats_.middleRemove((count_-pos-1)*sizeof(Pair));
+	if constexpr (relocatablePairs)
+	{
+		destroyPairs(data_+pos, 1);
+		memmove((void*)(data_+pos), (const void*)(data_+pos+1), (count_-pos-1)*sizeof(Pair));
+	}
+	else
+	{
+		std::move(data_+pos+1, data_+count_, data_+pos);
+		destroyPairs(data_+count_-1, 1);
+	}
 	count_--;
+	if (pos == 0)
+		firstKey_ = keyAt(0);
 }
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::equal(const OrderedKeyMap& o) const
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::equal(const OrderedKeyMap& o) const
 {
-	if (count_ != o.count() || firstKey_ != o.firstKey_ || lastKey_ != o.lastKey_)
-		return false;
-	if (sizeof(TYPE) % 8 == 0)
-		return memcmp(data_, o.data_, o.count_*sizeof(Pair)) == 0;
-	auto itc = constBegin();
-	for (auto it = o.constBegin(); it != o.constEnd(); ++it, ++itc)
-		if (it.key() != itc.key() || it.value() != itc.value())
+	return *this == o;
+}
+
+// Whether key fits the offset range of the map. A key below keyBase() moves the base down,
+// that rewrites all the offsets like an insert at the beginning moves all the pairs.
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::encodable(KTYPE key)
+{
+	if constexpr (narrowKeys)
+	{
+		typedef std::make_unsigned_t<KTYPE> UKTYPE;
+		constexpr UKTYPE maxOffset = std::numeric_limits<stored_key_type>::max();
+		if (empty())
+			keyBase_ = key;
+		else if (key < keyBase_)
+		{
+			if (UKTYPE(lastKey_) - UKTYPE(key) > maxOffset)
+			{
+				stats_.miss();
+				DWLOG(name + QString(" OKM: Key %1 is out of the offset range %2-%3").arg(key).arg(firstKey_).arg(lastKey_));
+				return false;
+			}
+			detachShared();
+			auto shift = stored_key_type(UKTYPE(keyBase_) - UKTYPE(key));
+			for (size_type i = 0; i < count_; i++)
+				data_[i].key = stored_key_type(data_[i].key + shift);
+			keyBase_ = key;
+		}
+		else if (UKTYPE(key) - UKTYPE(keyBase_) > maxOffset)
+		{
+			stats_.miss();
+			DWLOG(name + QString(" OKM: Key %1 is out of the offset range %2-%3").arg(key).arg(firstKey_).arg(lastKey_));
 			return false;
+		}
+	}
+	return true;
+}
+
+// Whether the keys first..last of an ordered run fit, an empty map is based on first.
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::encodable(KTYPE first, KTYPE last)
+{
+	if constexpr (narrowKeys)
+	{
+		if (!empty())
+			return encodable(first) && encodable(last);
+		typedef std::make_unsigned_t<KTYPE> UKTYPE;
+		if (UKTYPE(last) - UKTYPE(first) > std::numeric_limits<stored_key_type>::max())
+		{
+			stats_.miss();
+			DWLOG(name + QString(" OKM: Keys %1-%2 do not fit the offset range").arg(first).arg(last));
+			return false;
+		}
+		keyBase_ = first;
+	}
+	return true;
+}
+
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::equalRebased(const OrderedKeyMap& o) const
+{
+	for (size_type i = 0; i < count_; i++)
+	{
+		if (keyAt(i) != o.keyAt(i) || !equalMembers(data_[i].value, o.data_[i].value))
+			return false;
+	}
 	return true;
 }
 
 #ifdef QMAP_H
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::equal(const QMap<KTYPE, TYPE>& o) const
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::equal(const QMap<KTYPE, TYPE>& o) const
 {
 	if (count_ != o.count() || firstKey_ != o.firstKey() || lastKey_ != o.lastKey())
 		return false;
@@ -346,32 +723,41 @@ bool OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::equal(const QMap<KTYPE, TYPE>& o
 }
 #endif
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-TYPE& OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::valueNearPos(KTYPE key, int pos)
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+TYPE& OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::valueNearPos(KTYPE key, size_type pos)
+{
+	pos = nearPos(key, pos);
+	if (pos < 0)
+		return emptyVal;
+	detachShared();
+	return dataAt(pos).value;
+}
+
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::size_type OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::nearPos(KTYPE key, size_type pos) const
 {
 	if (pos < count_ && pos >= 0)
 	{
-		auto& data = dataAt(pos);
-		if (data.key == key)
-			return data.value;
-		int p = key > data.key ? 1 : -1;
-		int pos2 = pos;
-		do
+		KTYPE atKey = keyAt(pos);
+		if (atKey == key)
+			return pos;
+		int p = key > atKey ? 1 : -1;
+		// walks towards the key until it is found or passed
+		for (size_type pos2 = pos + p; pos2 >= 0 && pos2 < count_; pos2 += p)
 		{
-			pos2 += p;
-			auto& data2 = dataAt(pos2);
-			if (data.key == key)
+			KTYPE atKey2 = keyAt(pos2);
+			if (atKey2 == key)
 			{
 				DWLOG(name + QString("OKM: Miss - key %1 pos %2 pos2 %3").arg(key).arg(pos).arg(pos2));
-				return data2.value;
+				return pos2;
 			}
-			else if (p*(data2.key - key) > 0)
+			if (p > 0 ? atKey2 > key : atKey2 < key)
 				break;
-
-		} while(pos2 >= 0 && pos2 < count_);
+		}
 	}
+	stats_.miss();
 	DWLOG(name + "OKM: Miss - valueNearPos");
-	return emptyVal;
+	return -1;
 }
 
 enum class SearchType
@@ -381,104 +767,124 @@ enum class SearchType
 	Find
 };
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM = FindAlgorithm::BinarySeparation>
-static inline typename OrderedKeyMap<KTYPE, TYPE, FindAlgorithm::BinarySeparation>::iterator internalSearch(
-		const OrderedKeyMap<KTYPE, TYPE, FindAlgorithm::BinarySeparation>& container, KTYPE key, SearchType stype)
+struct NoProbes
 {
-	int begin = 0, end = container.count()-1;
-	while (begin + 1 < end)
-	{
-		auto pos = (end+begin)/2;
-		auto& atval = container.dataAt(pos);
-		if (atval.key == key)
-		{
-			if (stype == SearchType::UpperBound)
-				pos++;
-			return typename OrderedKeyMap<KTYPE, TYPE, FindAlgorithm::BinarySeparation>::iterator(&container, pos);
-		}
-		key > atval.key ? begin = pos : end = pos;
-	}
-	if (stype == SearchType::LowerBound || stype == SearchType::UpperBound)
-		return typename OrderedKeyMap<KTYPE, TYPE, FindAlgorithm::BinarySeparation>::iterator(&container, end);
-	return container.constEnd();
-}
+	inline void operator()(int) const {}
+};
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM = FindAlgorithm::RelativePrediction>
-static inline typename OrderedKeyMap<KTYPE, TYPE, FindAlgorithm::RelativePrediction>::iterator internalSearch(
-		const OrderedKeyMap<KTYPE, TYPE, FindAlgorithm::RelativePrediction>& container, KTYPE key, SearchType stype)
+// Searches the ordered keys keyAt(0)..keyAt(count-1) for firstKey < key < lastKey.
+// Returns the position of the key (the next one for UpperBound), the bound position, or count on a Find miss.
+// The number of keys read is passed to probes() once per search.
+template <FindAlgorithm FINDALGORITHM, typename KTYPE, typename KEYAT, typename PROBES = NoProbes>
+static inline std::ptrdiff_t internalSearchPos(const KEYAT& keyAt, std::ptrdiff_t count,
+		KTYPE firstKey, KTYPE lastKey, KTYPE key, SearchType stype, const PROBES& probes = PROBES())
 {
-	int begin = 0,  end = container.count()-1;
-	KTYPE beginKey = container.firstKey(), endKey = container.lastKey();
+	std::ptrdiff_t begin = 0, end = count-1;
+	KTYPE beginKey = firstKey, endKey = lastKey;
+	int depth = 0;
 	while (begin + 1 < end)
 	{
-		int pos = begin + (end-begin)*float(key-beginKey)/(endKey-beginKey);
-		if (pos <= begin)
-			pos = begin+1;
-		else if (pos >= end)
-			pos = end-1;
-		auto& atval = container.dataAt(pos);
-		if (atval.key == key)
+		depth++;
+		std::ptrdiff_t pos;
+		if constexpr (FINDALGORITHM == FindAlgorithm::BinarySeparation)
+			pos = (end+begin)/2;
+		else
+		{
+			pos = begin + (end-begin)*double(key-beginKey)/(endKey-beginKey);
+			if (pos <= begin)
+				pos = begin+1;
+			else if (pos >= end)
+				pos = end-1;
+		}
+		KTYPE atkey = keyAt(pos);
+		if (atkey == key)
 		{
+			probes(depth);
 			if (stype == SearchType::UpperBound)
 				pos++;
-			return typename OrderedKeyMap<KTYPE, TYPE, FindAlgorithm::RelativePrediction>::iterator(&container, pos);
+			return pos;
 		}
-		if (key > atval.key)
+		if (key > atkey)
 		{
 			begin = pos;
-			beginKey = atval.key;
+			beginKey = atkey;
 		}
 		else
 		{
 			end = pos;
-			endKey = atval.key;
+			endKey = atkey;
 		}
 	}
+	probes(depth);
 	if (stype == SearchType::LowerBound || stype == SearchType::UpperBound)
-		return typename OrderedKeyMap<KTYPE, TYPE, FindAlgorithm::RelativePrediction>::iterator(&container, end);
-	return container.constEnd();
+		return end;
+	return count;
 }
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::lowerBound(KTYPE key) const
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+static inline typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::const_iterator internalSearch(
+		const OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>& container, KTYPE key, SearchType stype,
+		const OrderedKeyMapCounters<STATSMODE>& stats)
+{
+	// offset keys are searched as they are stored
+	typedef OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING> Map;
+	auto encode = [&container](KTYPE k) {
+		if constexpr (Map::narrowKeys) return typename Map::stored_key_type(k - container.keyBase()); else return k;};
+	auto pos = internalSearchPos<FINDALGORITHM>([&container](std::ptrdiff_t p) {return container.dataAt(p).key;},
+			container.count(), encode(container.firstKey()), encode(container.lastKey()), encode(key), stype,
+			[&stats](int n) {stats.search(n);});
+	return typename Map::const_iterator(&container, pos);
+}
+
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::const_iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::lowerBound(KTYPE key) const
 {
 	if (empty() || key > lastKey_)
 		return constEnd();
 	if (key == lastKey_)
-		return iterator(this, count_-1);
+		return const_iterator(this, count_-1);
 	if (key <= firstKey_)
-		return iterator(this, 0);
-	return internalSearch<KTYPE, TYPE, FINDALGORITHM>(*this, key, SearchType::LowerBound);
+		return const_iterator(this, 0);
+	return internalSearch<KTYPE, TYPE, FINDALGORITHM>(*this, key, SearchType::LowerBound, stats_);
 }
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::upperBoundAlt(KTYPE key) const
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::const_iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::upperBoundAlt(KTYPE key) const
 {
 	if (empty() || key >= lastKey_)
 		return constEnd();
 	if (key == firstKey_)
-		return iterator(this, 1);
+		return const_iterator(this, 1);
 	if (key < firstKey_)
-		return iterator(this, 0);
-	return internalSearch<KTYPE, TYPE, FINDALGORITHM>(*this, key, SearchType::UpperBound);
+		return const_iterator(this, 0);
+	return internalSearch<KTYPE, TYPE, FINDALGORITHM>(*this, key, SearchType::UpperBound, stats_);
 }
 
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-TYPE& OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::operator [](KTYPE key)
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+TYPE& OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::operator [](KTYPE key)
 {
 	if (key == lastKey_)
 		return last();
+	if (!encodable(key))
+		return emptyVal;
 	if (key > lastKey_)
+	{
+		stats_.miss();
 		return this->insert(key, TYPE()).value();
+	}
+	detachShared();
 	auto it = lowerBound(key);
 	if (it.key() != key)
+	{
+		stats_.miss();
 		return this->insertBefore(it.pos(), key, TYPE());
+	}
 	return it.value();
 }
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::find(KTYPE key)
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::const_iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::find(KTYPE key) const
 {
 	auto it = lowerBound(key);
 	if (it == constEnd() || it.key() == key)
@@ -486,29 +892,29 @@ typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::iterator OrderedKeyMap<KTYPE
 	return constEnd();
 }
 
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::findAlt(KTYPE key)
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+typename OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::const_iterator OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::findAlt(KTYPE key) const
 {
 	if (empty() || key > lastKey_ || key < firstKey_)
 		return constEnd();
 	if (key == lastKey_)
-		return iterator(this, count_-1);
+		return const_iterator(this, count_-1);
 	if (key == firstKey_)
-		return iterator(this, 0);
-	return internalSearch<KTYPE, TYPE, FINDALGORITHM>(*this, key, SearchType::Find);
+		return const_iterator(this, 0);
+	return internalSearch<KTYPE, TYPE, FINDALGORITHM>(*this, key, SearchType::Find, stats_);
 }
 
 #ifdef QLIST_H
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-QList<KTYPE> OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::keys() const
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+QList<KTYPE> OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::keys() const
 {
 	QList<KTYPE> res;
 	for (auto it = constBegin(); it != constEnd(); ++it)
 		res.append(it.key());
 	return res;
 }
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-QList<KTYPE> OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::keys(KTYPE min, KTYPE max) const
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+QList<KTYPE> OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::keys(KTYPE min, KTYPE max) const
 {
 	QList<KTYPE> res;
 	auto itEnd = max ? upperBound(max) : constEnd();
@@ -516,8 +922,8 @@ QList<KTYPE> OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::keys(KTYPE min, KTYPE ma
 		res.append(it.key());
 	return res;
 }
-template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM>
-QList<TYPE> OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM>::values() const
+template <typename KTYPE, typename TYPE, FindAlgorithm FINDALGORITHM, CopyMode COPYMODE, StatsMode STATSMODE, KeyEncoding KEYENCODING>
+QList<TYPE> OrderedKeyMap<KTYPE, TYPE, FINDALGORITHM, COPYMODE, STATSMODE, KEYENCODING>::values() const
 {
 	QList<TYPE> res;
 	for (auto it = constBegin(); it != constEnd(); ++it)
@@ -0,0 +1,457 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#pragma once
+
+#include "OrderedKeyMap.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <latch>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace Smitto {
+
+// Worker threads pinned to cpus, by default to the cpus the process may run on. Each worker has a queue of pinned tasks that only it runs
+// and a queue of stealable tasks that idle workers take from its back.
+// wait() and blocking calls must not be made from inside a task.
+class OrderedKeyExecutor
+{
+public:
+	typedef std::function<void()> Task;
+
+	explicit OrderedKeyExecutor(int threads = std::thread::hardware_concurrency(), const std::vector<int>& cpus = {});
+	~OrderedKeyExecutor();
+	OrderedKeyExecutor(const OrderedKeyExecutor&) = delete;
+	OrderedKeyExecutor& operator = (const OrderedKeyExecutor&) = delete;
+
+	inline int threads() const {return int(workers_.size());}
+	// cpu the worker is pinned to, -1 when not pinned or when pinning failed
+	inline int cpu(int worker) const {return workers_[worker]->cpu;}
+	void post(int worker, Task task) {push(worker, std::move(task), false);}
+	void spawn(int worker, Task task) {push(worker, std::move(task), true);}
+	// until every posted and spawned task has finished
+	void wait();
+
+private:
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<Task> pinned;
+		std::deque<Task> stealable;
+		std::atomic<int> pinnedCount{0};
+		std::atomic<int> stealableCount{0};
+		std::thread thread;
+		int cpu = -1;
+	};
+	void push(int worker, Task&& task, bool stealable);
+	bool take(int worker, Task& task);
+	bool hasWork(int worker) const;
+	void run(int worker);
+	static std::vector<int> allowedCpus();
+	static bool pin(std::thread& thread, int cpu);
+
+private:
+	std::vector<std::unique_ptr<Worker>> workers_;
+	std::mutex sleepMutex_;
+	std::condition_variable sleep_;
+	std::mutex doneMutex_;
+	std::condition_variable done_;
+	std::atomic<std::int64_t> pending_{0};
+	bool stop_ = false;
+};
+
+inline OrderedKeyExecutor::OrderedKeyExecutor(int threads, const std::vector<int>& cpus)
+{
+	threads = std::max(1, threads);
+	// without a cpu list workers are pinned only when each gets its own allowed cpu
+	auto allowed = cpus.empty() ? allowedCpus() : cpus;
+	bool pinned = !cpus.empty() || (!allowed.empty() && threads <= int(allowed.size()));
+	for (int i = 0; i < threads; i++)
+	{
+		workers_.push_back(std::make_unique<Worker>());
+		if (pinned)
+			workers_.back()->cpu = allowed[i % allowed.size()];
+	}
+	// pinned from here: tasks arrive only after the constructor, and cpu() is settled when it returns
+	for (int i = 0; i < threads; i++)
+	{
+		auto& w = *workers_[i];
+		w.thread = std::thread([this, i]() {run(i);});
+		if (w.cpu >= 0 && !pin(w.thread, w.cpu))
+			w.cpu = -1;
+	}
+}
+
+inline OrderedKeyExecutor::~OrderedKeyExecutor()
+{
+	wait();
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex_);
+		stop_ = true;
+	}
+	sleep_.notify_all();
+	for (auto& worker : workers_)
+		worker->thread.join();
+}
+
+inline void OrderedKeyExecutor::push(int worker, Task&& task, bool stealable)
+{
+	auto& w = *workers_[worker % threads()];
+	pending_.fetch_add(1, std::memory_order_relaxed);
+	{
+		std::lock_guard<std::mutex> lock(w.mutex);
+		if (stealable)
+		{
+			w.stealable.push_back(std::move(task));
+			w.stealableCount.fetch_add(1, std::memory_order_release);
+		}
+		else
+		{
+			w.pinned.push_back(std::move(task));
+			w.pinnedCount.fetch_add(1, std::memory_order_release);
+		}
+	}
+	// taking the sleep lock orders the push before the predicate check of a sleeping worker
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex_);
+	}
+	sleep_.notify_all();
+}
+
+inline bool OrderedKeyExecutor::take(int worker, Task& task)
+{
+	auto& own = *workers_[worker];
+	if (own.pinnedCount.load(std::memory_order_acquire) || own.stealableCount.load(std::memory_order_acquire))
+	{
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.pinned.empty())
+		{
+			task = std::move(own.pinned.front());
+			own.pinned.pop_front();
+			own.pinnedCount.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+		if (!own.stealable.empty())
+		{
+			task = std::move(own.stealable.front());
+			own.stealable.pop_front();
+			own.stealableCount.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	for (int i = 1; i < threads(); i++)
+	{
+		auto& victim = *workers_[(worker + i) % threads()];
+		if (!victim.stealableCount.load(std::memory_order_acquire))
+			continue;
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (victim.stealable.empty())
+			continue;
+		task = std::move(victim.stealable.back());
+		victim.stealable.pop_back();
+		victim.stealableCount.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+inline bool OrderedKeyExecutor::hasWork(int worker) const
+{
+	if (workers_[worker]->pinnedCount.load(std::memory_order_acquire))
+		return true;
+	for (auto& w : workers_)
+		if (w->stealableCount.load(std::memory_order_acquire))
+			return true;
+	return false;
+}
+
+inline void OrderedKeyExecutor::run(int worker)
+{
+	Task task;
+	for (;;)
+	{
+		if (take(worker, task))
+		{
+			task();
+			task = nullptr;
+			if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				std::lock_guard<std::mutex> lock(doneMutex_);
+				done_.notify_all();
+			}
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex_);
+		sleep_.wait(lock, [this, worker]() {return stop_ || hasWork(worker);});
+		if (stop_)
+			return;
+	}
+}
+
+inline void OrderedKeyExecutor::wait()
+{
+	std::unique_lock<std::mutex> lock(doneMutex_);
+	done_.wait(lock, [this]() {return pending_.load(std::memory_order_acquire) == 0;});
+}
+
+// cpus of the process affinity mask (taskset, cgroup cpusets), empty where it is not known
+inline std::vector<int> OrderedKeyExecutor::allowedCpus()
+{
+	std::vector<int> res;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &set))
+				res.push_back(cpu);
+#endif
+	return res;
+}
+
+inline bool OrderedKeyExecutor::pin(std::thread& thread, int cpu)
+{
+#ifdef __linux__
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+	(void)thread;
+	(void)cpu;
+	return false;
+#endif
+}
+
+/// ------------------------------------------------------------------------------------------------
+
+// Maps of many symbols split into shards, one shard per executor worker.
+// A map is created and updated by its shard worker, so its pages are first touched on that core's node.
+// Initial reservations are learned from the sizes the symbols reached in earlier sessions.
+template <typename MAP>
+class OrderedKeyMapRegistry
+{
+public:
+	typedef std::uint32_t SymbolId;
+	typedef typename MAP::size_type size_type;
+
+	struct Options
+	{
+		int shards = std::thread::hardware_concurrency();
+		std::vector<int> cpus;             // cpu of every shard, by default the cpus of the process affinity mask in order
+		size_type unknownReserve = 256;    // pairs reserved for a symbol without history
+		size_type minReserve = 16;
+		double headroom = 1.25;            // reserve = learned size * headroom
+	};
+
+	explicit OrderedKeyMapRegistry(const Options& options = Options()) : options_(options), executor_(options.shards, options.cpus),
+		shardLoad_(executor_.threads(), 0) {}
+	~OrderedKeyMapRegistry() {executor_.wait();}
+
+	// Creates the maps of new symbols on their shards, returns when they exist.
+	void add(const std::vector<SymbolId>& ids);
+	void add(SymbolId id) {add(std::vector<SymbolId>{id});}
+	bool contains(SymbolId id) const {std::shared_lock<std::shared_mutex> lock(mutex_); return entries_.count(id);}
+	int shardOf(SymbolId id) const {auto e = entry(id); return e ? e->shard : -1;}
+	// Direct access to a map, only for tasks of its shard or while nothing is queued.
+	MAP* map(SymbolId id) const {auto e = entry(id); return e && e->map ? &*e->map : nullptr;}
+
+	// Runs fn(map) on the shard of the symbol, in the order of the calls for the same shard.
+	template <typename FN> void update(SymbolId id, FN fn);
+	// Applies the queued updates, then runs fn(id, map) for every symbol in parallel and returns when all are done.
+	// Tasks start on the symbol's shard and are stolen by idle shards; the symbol is locked during fn.
+	template <typename FN> void forEach(const std::vector<SymbolId>& ids, FN fn);
+	template <typename FN> void forEach(FN fn) {forEach(symbols(), fn);}
+	// until all updates have been applied
+	void wait() {executor_.wait();}
+	std::vector<SymbolId> symbols() const;
+	OrderedKeyExecutor& executor() {return executor_;}
+
+// adaptive sizing
+	size_type initialReserve(SymbolId id) const;
+	// Learns the current sizes of all maps, call it at the end of a session.
+	void endSession();
+	bool saveHistory(const char* path) const;
+	bool loadHistory(const char* path);
+
+private:
+	struct Entry
+	{
+		std::mutex mutex;
+		std::optional<MAP> map;
+		int shard;
+	};
+	Entry* entry(SymbolId id) const {
+		std::shared_lock<std::shared_mutex> lock(mutex_);
+		auto it = entries_.find(id);
+		return it == entries_.end() ? nullptr : it->second.get();}
+	size_type learned(SymbolId id) const {auto it = history_.find(id); return it == history_.end() ? -1 : it->second;}
+	size_type reserveFor(SymbolId id) const {auto size = learned(id);
+		return size < 0 ? options_.unknownReserve : std::max(options_.minReserve, size_type(size*options_.headroom));}
+
+private:
+	const Options options_;
+	OrderedKeyExecutor executor_;
+	mutable std::shared_mutex mutex_;
+	std::unordered_map<SymbolId, std::unique_ptr<Entry>> entries_;
+	std::unordered_map<SymbolId, size_type> history_;
+	std::vector<size_type> shardLoad_;  // expected pairs per shard
+};
+
+template <typename MAP>
+typename OrderedKeyMapRegistry<MAP>::size_type OrderedKeyMapRegistry<MAP>::initialReserve(SymbolId id) const
+{
+	std::shared_lock<std::shared_mutex> lock(mutex_);
+	return reserveFor(id);
+}
+
+template <typename MAP>
+void OrderedKeyMapRegistry<MAP>::add(const std::vector<SymbolId>& ids)
+{
+	std::vector<std::pair<Entry*, size_type>> created;
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		for (auto id : ids)
+		{
+			if (entries_.count(id))
+				continue;
+			auto size = reserveFor(id);
+			// the least loaded shard by expected size
+			auto shard = int(std::min_element(shardLoad_.begin(), shardLoad_.end()) - shardLoad_.begin());
+			shardLoad_[shard] += size;
+			auto& e = entries_[id];
+			e = std::make_unique<Entry>();
+			e->shard = shard;
+			created.emplace_back(e.get(), size);
+		}
+	}
+	if (created.empty())
+		return;
+	std::latch done(created.size());
+	for (auto [e, size] : created)
+		executor_.post(e->shard, [e, size, &done]() {
+			{
+				std::lock_guard<std::mutex> lock(e->mutex);
+				e->map.emplace(size);
+			}
+			done.count_down();
+		});
+	done.wait();
+}
+
+template <typename MAP>
+template <typename FN>
+void OrderedKeyMapRegistry<MAP>::update(SymbolId id, FN fn)
+{
+	auto e = entry(id);
+	if (!e)
+		return;
+	executor_.post(e->shard, [e, fn = std::move(fn)]() mutable {
+		std::lock_guard<std::mutex> lock(e->mutex);
+		fn(*e->map);
+	});
+}
+
+template <typename MAP>
+template <typename FN>
+void OrderedKeyMapRegistry<MAP>::forEach(const std::vector<SymbolId>& ids, FN fn)
+{
+	executor_.wait();
+	std::vector<std::pair<SymbolId, Entry*>> found;
+	found.reserve(ids.size());
+	for (auto id : ids)
+		if (auto e = entry(id))
+			found.emplace_back(id, e);
+	if (found.empty())
+		return;
+	std::latch done(found.size());
+	for (auto [id, e] : found)
+		executor_.spawn(e->shard, [id = id, e = e, &fn, &done]() {
+			{
+				std::lock_guard<std::mutex> lock(e->mutex);
+				fn(id, std::as_const(*e->map));
+			}
+			done.count_down();
+		});
+	done.wait();
+}
+
+template <typename MAP>
+std::vector<typename OrderedKeyMapRegistry<MAP>::SymbolId> OrderedKeyMapRegistry<MAP>::symbols() const
+{
+	std::shared_lock<std::shared_mutex> lock(mutex_);
+	std::vector<SymbolId> res;
+	res.reserve(entries_.size());
+	for (auto& e : entries_)
+		res.push_back(e.first);
+	std::sort(res.begin(), res.end());
+	return res;
+}
+
+template <typename MAP>
+void OrderedKeyMapRegistry<MAP>::endSession()
+{
+	std::unordered_map<SymbolId, size_type> sizes;
+	std::mutex sizesMutex;
+	forEach([&sizes, &sizesMutex](SymbolId id, const MAP& map) {
+		std::lock_guard<std::mutex> lock(sizesMutex);
+		sizes[id] = map.count();
+	});
+	std::unique_lock<std::shared_mutex> lock(mutex_);
+	// follows growth at once and shrinks slowly, so one quiet day does not undersize the next busy one
+	for (auto [id, count] : sizes)
+	{
+		auto size = learned(id);
+		history_[id] = size < 0 ? count : std::max(count, (size + count)/2);
+	}
+}
+
+// text file with "symbol size" lines
+template <typename MAP>
+bool OrderedKeyMapRegistry<MAP>::saveHistory(const char* path) const
+{
+	FILE* f = fopen(path, "w");
+	if (!f)
+		return false;
+	std::shared_lock<std::shared_mutex> lock(mutex_);
+	for (auto& h : history_)
+		fprintf(f, "%u %lld\n", unsigned(h.first), (long long)h.second);
+	return fclose(f) == 0;
+}
+
+template <typename MAP>
+bool OrderedKeyMapRegistry<MAP>::loadHistory(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (!f)
+		return false;
+	std::unique_lock<std::shared_mutex> lock(mutex_);
+	unsigned id;
+	long long size;
+	while (fscanf(f, "%u %lld", &id, &size) == 2)
+		history_[id] = size;
+	fclose(f);
+	return true;
+}
+
+} // Smitto::
@@ -0,0 +1,96 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+
+namespace Smitto {
+
+enum class StatsMode
+{
+	None,     // no counters, everything compiles out
+	Local,    // plain counters for a map used by one thread
+	Atomic    // relaxed atomic counters, for maps searched from several threads or read by a monitor
+};
+
+// Snapshot of the counters of one map.
+struct OrderedKeyMapStats
+{
+	static constexpr int probeBuckets = 32;
+	uint64_t middleInserts = 0;  // inserts before the last key
+	uint64_t middleRemoves = 0;  // removes before the last key
+	uint64_t misses = 0;         // lookups of missing keys by operator[], value(), first(), last(), valueNearPos()
+	uint64_t realocs = 0;         // capacity growth
+	uint64_t detaches = 0;       // copies of a buffer shared by CopyMode::OnWrite maps before writing to it
+	uint64_t bytesMoved = 0;     // shifted by middle inserts and removes
+	uint64_t peakCapacity = 0;   // bytes
+	uint64_t probes[probeBuckets] = {}; // searches by probe count, the last bucket takes the deeper ones
+
+	uint64_t searches() const {uint64_t res = 0; for (auto n : probes) res += n; return res;}
+};
+
+template <StatsMode STATSMODE>
+class OrderedKeyMapCounters
+{
+public:
+	inline void middleInsert(uint64_t) {}
+	inline void middleRemove(uint64_t) {}
+	inline void miss() const {}
+	inline void realoc() {}
+	inline void detach() {}
+	inline void capacity(uint64_t) {}
+	inline void search(int) const {}
+	OrderedKeyMapStats snapshot() const {return OrderedKeyMapStats();}
+};
+
+template <typename COUNTER>
+class OrderedKeyMapCountersBase
+{
+public:
+	inline void middleInsert(uint64_t bytes) {add(s_.middleInserts, 1); add(s_.bytesMoved, bytes);}
+	inline void middleRemove(uint64_t bytes) {add(s_.middleRemoves, 1); add(s_.bytesMoved, bytes);}
+	inline void miss() const {add(s_.misses, 1);}
+	inline void realoc() {add(s_.realocs, 1);}
+	inline void detach() {add(s_.detaches, 1);}
+	inline void capacity(uint64_t bytes) {if (bytes > load(s_.peakCapacity)) store(s_.peakCapacity, bytes);}
+	inline void search(int probes) const {add(s_.probes[std::min(probes, OrderedKeyMapStats::probeBuckets-1)], 1);}
+	OrderedKeyMapStats snapshot() const {
+		OrderedKeyMapStats res;
+		res.middleInserts = load(s_.middleInserts); res.middleRemoves = load(s_.middleRemoves);
+		res.misses = load(s_.misses); res.realocs = load(s_.realocs); res.detaches = load(s_.detaches);
+		res.bytesMoved = load(s_.bytesMoved); res.peakCapacity = load(s_.peakCapacity);
+		for (int i = 0; i < OrderedKeyMapStats::probeBuckets; i++)
+			res.probes[i] = load(s_.probes[i]);
+		return res;}
+
+private:
+	static inline void add(COUNTER& c, uint64_t n) {
+		if constexpr (std::is_same_v<COUNTER, uint64_t>) c += n; else c.fetch_add(n, std::memory_order_relaxed);}
+	static inline uint64_t load(const COUNTER& c) {
+		if constexpr (std::is_same_v<COUNTER, uint64_t>) return c; else return c.load(std::memory_order_relaxed);}
+	// peak capacity changes only on the writing thread
+	static inline void store(COUNTER& c, uint64_t n) {
+		if constexpr (std::is_same_v<COUNTER, uint64_t>) c = n; else c.store(n, std::memory_order_relaxed);}
+
+private:
+	// const searches count too
+	mutable struct
+	{
+		COUNTER middleInserts{0}, middleRemoves{0}, misses{0}, realocs{0}, detaches{0}, bytesMoved{0}, peakCapacity{0};
+		COUNTER probes[OrderedKeyMapStats::probeBuckets] = {};
+	} s_;
+};
+
+template <>
+class OrderedKeyMapCounters<StatsMode::Local> : public OrderedKeyMapCountersBase<uint64_t> {};
+
+template <>
+class OrderedKeyMapCounters<StatsMode::Atomic> : public OrderedKeyMapCountersBase<std::atomic<uint64_t>> {};
+
+} // Smitto::
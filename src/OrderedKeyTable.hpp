@@ -0,0 +1,310 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#pragma once
+
+#include "OrderedKeyMap.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <ranges>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#ifndef DWLOG
+#define DWLOG(text)
+#define TEMPORATY_DWLOG_DISABLED
+#endif
+
+namespace Smitto {
+
+// Key type tag of OrderedKeyTable: KTYPE keys are stored as OFFSET distances from per-block bases,
+// so a cache line and a search step hold sizeof(KTYPE)/sizeof(OFFSET) times more keys.
+template <typename KTYPE, typename OFFSET = std::uint32_t>
+struct NarrowKey
+{
+	static_assert(std::is_unsigned_v<OFFSET> && sizeof(OFFSET) < sizeof(KTYPE), "OFFSET must be a narrower unsigned type");
+};
+
+// Key column of OrderedKeyTable, positions past count are not constructed.
+template <typename KTYPE>
+class OrderedKeyStore
+{
+public:
+	typedef KTYPE key_type;
+	typedef std::ptrdiff_t size_type;
+
+	inline KTYPE keyAt(size_type pos) const {return keys_[pos];}
+	std::span<const KTYPE> view(size_type count) const {return std::span<const KTYPE>(keys_, count);}
+	size_type lowerBound(KTYPE key, size_type count, KTYPE firstKey, KTYPE lastKey) const {
+		return internalSearchPos<FindAlgorithm::BinarySeparation>([this](size_type pos) {return keys_[pos];},
+				count, firstKey, lastKey, key, SearchType::LowerBound);}
+	inline void append(size_type count, KTYPE key) {keys_[count] = key;}
+	void insertAt(size_type pos, size_type count, KTYPE key) {
+		memmove(keys_+pos+1, keys_+pos, (count-pos)*sizeof(KTYPE)); keys_[pos] = key;}
+	void removeAt(size_type pos, size_type count) {memmove(keys_+pos, keys_+pos+1, (count-pos-1)*sizeof(KTYPE));}
+	void clear() {}
+
+	void reserve(size_type k) {keys_ = (KTYPE*)realloc(keys_, k*sizeof(KTYPE));}
+	void release() {free(keys_); keys_ = nullptr;}
+	void copy(const OrderedKeyStore& o, size_type count) {memcpy(keys_, o.keys_, count*sizeof(KTYPE));}
+	void take(OrderedKeyStore& o) {keys_ = o.keys_; o.keys_ = nullptr;}
+
+private:
+	KTYPE* keys_ = nullptr;
+};
+
+// Blocks of at most blockSize keys, each key is an offset from the first key of its block.
+// A key too far from the block base starts a new block. Search finds the block by its base,
+// then bisects the narrow offsets inside it. Middle inserts and removes re-encode the tail.
+template <typename KTYPE, typename OFFSET>
+class OrderedKeyStore<NarrowKey<KTYPE, OFFSET>>
+{
+public:
+	typedef KTYPE key_type;
+	typedef std::ptrdiff_t size_type;
+	static constexpr size_type blockSize = 1024;
+
+	inline KTYPE keyAt(size_type pos) const {return bases_[blockOf(pos)] + KTYPE(offsets_[pos]);}
+	auto view(size_type count) const {
+		return std::views::iota(size_type(0), count) | std::views::transform([this](size_type pos) {return keyAt(pos);});}
+	size_type lowerBound(KTYPE key, size_type count, KTYPE, KTYPE) const {
+		size_type b = std::upper_bound(bases_.begin(), bases_.end(), key) - bases_.begin() - 1;
+		size_type end = b+1 < size_type(starts_.size()) ? starts_[b+1] : count;
+		KTYPE delta = key - bases_[b];
+		if (delta > maxOffset) // key is in the gap after the block
+			return end;
+		return std::lower_bound(offsets_+starts_[b], offsets_+end, OFFSET(delta)) - offsets_;}
+	inline void append(size_type count, KTYPE key) {
+		if (bases_.empty() || count - starts_.back() >= blockSize || key - bases_.back() > maxOffset)
+		{
+			bases_.push_back(key);
+			starts_.push_back(count);
+		}
+		offsets_[count] = OFFSET(key - bases_.back());}
+	void insertAt(size_type pos, size_type count, KTYPE key) {
+		auto b = blockOf(pos); auto keys = decode(starts_[b], count);
+		keys.insert(keys.begin() + (pos - starts_[b]), key); encode(b, keys);}
+	void removeAt(size_type pos, size_type count) {
+		auto b = blockOf(pos); auto keys = decode(starts_[b], count);
+		keys.erase(keys.begin() + (pos - starts_[b])); encode(b, keys);}
+	void clear() {bases_.clear(); starts_.clear();}
+
+	void reserve(size_type k) {offsets_ = (OFFSET*)realloc(offsets_, k*sizeof(OFFSET));}
+	void release() {free(offsets_); offsets_ = nullptr; clear();}
+	void copy(const OrderedKeyStore& o, size_type count) {
+		memcpy(offsets_, o.offsets_, count*sizeof(OFFSET)); bases_ = o.bases_; starts_ = o.starts_;}
+	void take(OrderedKeyStore& o) {
+		offsets_ = o.offsets_; o.offsets_ = nullptr; bases_ = std::move(o.bases_); starts_ = std::move(o.starts_); o.clear();}
+
+private:
+	static constexpr KTYPE maxOffset = KTYPE(std::numeric_limits<OFFSET>::max());
+	// blocks are never longer than blockSize, so the block of pos is pos/blockSize or a later one
+	inline size_type blockOf(size_type pos) const {
+		size_type b = std::min(pos/blockSize, size_type(starts_.size())-1);
+		if (b+1 == size_type(starts_.size()) || starts_[b+1] > pos)
+			return b;
+		return std::upper_bound(starts_.begin()+b, starts_.end(), pos) - starts_.begin() - 1;}
+	std::vector<KTYPE> decode(size_type from, size_type count) const {
+		std::vector<KTYPE> keys;
+		keys.reserve(count - from + 1);
+		for (auto pos = from; pos < count; pos++)
+			keys.push_back(keyAt(pos));
+		return keys;}
+	void encode(size_type block, const std::vector<KTYPE>& keys) {
+		size_type from = starts_[block];
+		bases_.resize(block);
+		starts_.resize(block);
+		for (size_type i = 0; i < size_type(keys.size()); i++)
+			append(from+i, keys[i]);}
+
+private:
+	OFFSET* offsets_ = nullptr;
+	std::vector<KTYPE> bases_;
+	std::vector<size_type> starts_;
+};
+
+// Several value columns sharing one ordered key array.
+// A search returns a row position, column values at that position are read without another search.
+// KEY is the key type or NarrowKey<KTYPE, OFFSET> to store keys as narrow offsets.
+template <typename KEY, typename... Columns>
+class OrderedKeyTable
+{
+	static_assert(sizeof...(Columns) > 0, "OrderedKeyTable needs at least one column");
+	static_assert((std::is_trivially_copyable_v<Columns> && ...), "OrderedKeyTable columns are moved by memcpy");
+	typedef OrderedKeyStore<KEY> KeyStore;
+	typedef typename KeyStore::key_type KTYPE;
+public:
+	typedef KTYPE key_type;
+	typedef std::ptrdiff_t size_type;
+	template <std::size_t N> using ColumnType = std::tuple_element_t<N, std::tuple<Columns...>>;
+	static constexpr std::size_t columnCount = sizeof...(Columns);
+
+// standard
+	inline size_type count() const {return count_;}
+	inline size_type size() const {return count_;}
+	inline bool isEmpty() const {return !count_;}
+	inline bool empty() const {return isEmpty();}
+	inline KTYPE lastKey() const {return lastKey_;}
+	inline KTYPE firstKey() const {return firstKey_;}
+	inline bool contains(KTYPE key) const {return find(key) != count_;}
+	size_type insert(KTYPE key, const Columns&... values);
+	inline size_type append(KTYPE key, const Columns&... values) {return insert(key, values...);}
+	void remove(KTYPE key);
+	inline void clear() {count_ = 0; lastKey_ = 0; firstKey_ = 0; keys_.clear();}
+
+// positions, count() is the end position
+	size_type find(KTYPE key) const;
+	size_type lowerBound(KTYPE key) const;
+	size_type upperBound(KTYPE key) const {auto pos = lowerBound(key); if (pos == count_ || key < keyAt(pos)) return pos; return pos+1;}
+	inline KTYPE keyAt(size_type pos) const {return keys_.keyAt(pos);}
+	template <std::size_t N> inline ColumnType<N>& valueAt(size_type pos) {return std::get<N>(columns_)[pos];}
+	template <std::size_t N> inline const ColumnType<N>& valueAt(size_type pos) const {return std::get<N>(columns_)[pos];}
+	inline std::tuple<Columns&...> row(size_type pos) {
+		return std::apply([pos](auto*... column) {return std::tuple<Columns&...>(column[pos]...);}, columns_);}
+	inline std::tuple<Columns...> row(size_type pos) const {
+		return std::apply([pos](auto*... column) {return std::tuple<Columns...>(column[pos]...);}, columns_);}
+
+// columns as contiguous ranges
+	auto keys() const {return keys_.view(count_);}
+	auto keysView() const {return keys();}
+	template <std::size_t N> std::span<ColumnType<N>> column() {return std::span<ColumnType<N>>(std::get<N>(columns_), count_);}
+	template <std::size_t N> std::span<const ColumnType<N>> column() const {return std::span<const ColumnType<N>>(std::get<N>(columns_), count_);}
+	// rows with keys from..to, empty when to < from
+	template <std::size_t N> std::span<const ColumnType<N>> column(KTYPE from, KTYPE to) const {
+		auto begin = lowerBound(from); auto end = std::max(begin, upperBound(to));
+		return std::span<const ColumnType<N>>(std::get<N>(columns_)+begin, end-begin);}
+
+// constructors
+	OrderedKeyTable(size_type size = BASESIZE) {if (size > 0) reserveData(size);}
+	OrderedKeyTable(const OrderedKeyTable& o) {if (o.capacity_) reserveData(o.capacity_); copyRows(o);}
+	OrderedKeyTable(OrderedKeyTable&& o) noexcept {take(o);}
+	~OrderedKeyTable() {dealoc();}
+
+// operators
+	OrderedKeyTable& operator = (const OrderedKeyTable& o) {
+		if (this == &o) return *this;
+		if (capacity_ < o.count_) {dealoc(); reserveData(o.capacity_);}
+		copyRows(o); return *this;}
+	OrderedKeyTable& operator = (OrderedKeyTable&& o) noexcept {if (this != &o) {dealoc(); take(o);} return *this;}
+
+	void reserve(size_type k) {if (k > capacity_) realoc(k);}
+
+private:
+	void reserveData(size_type k) {
+		capacity_ = k; keys_.reserve(k);
+		std::apply([k](auto*&... column) {((column = (std::remove_reference_t<decltype(*column)>*)
+				malloc(k*sizeof(*column))), ...);}, columns_);}
+	void realoc(size_type k) {
+		capacity_ = k; keys_.reserve(k);
+		std::apply([k](auto*&... column) {((column = (std::remove_reference_t<decltype(*column)>*)
+				realloc(column, k*sizeof(*column))), ...);}, columns_);}
+	void dealoc() {
+		clear(); keys_.release(); capacity_ = 0;
+		std::apply([](auto*&... column) {((free(column), column = nullptr), ...);}, columns_);}
+	void copyRows(const OrderedKeyTable& o) {
+		count_ = o.count_; lastKey_ = o.lastKey_; firstKey_ = o.firstKey_;
+		if (!count_) {keys_.clear(); return;}
+		keys_.copy(o.keys_, count_);
+		copyColumns(o, std::index_sequence_for<Columns...>());}
+	template <std::size_t... N> void copyColumns(const OrderedKeyTable& o, std::index_sequence<N...>) {
+		(memcpy(std::get<N>(columns_), std::get<N>(o.columns_), count_*sizeof(ColumnType<N>)), ...);}
+	void take(OrderedKeyTable& o) {
+		capacity_ = o.capacity_; count_ = o.count_; keys_.take(o.keys_); columns_ = o.columns_;
+		lastKey_ = o.lastKey_; firstKey_ = o.firstKey_;
+		o.capacity_ = 0; o.count_ = 0; o.columns_ = {}; o.lastKey_ = 0; o.firstKey_ = 0;}
+	// shifts column values [pos, count_) by shift rows, both directions
+	void moveValues(size_type pos, size_type shift) {
+		std::apply([&](auto*... column) {(memmove(column+pos+shift, column+pos, (count_-pos)*sizeof(*column)), ...);}, columns_);}
+	void setValues(size_type pos, const Columns&... values) {
+		std::apply([&](auto*... column) {((column[pos] = values), ...);}, columns_);}
+
+private:
+	size_type capacity_ = 0;
+	size_type count_ = 0;
+	KeyStore keys_;
+	std::tuple<Columns*...> columns_;
+	KTYPE lastKey_ = 0;
+	KTYPE firstKey_ = 0;
+};
+
+template <typename KEY, typename... Columns>
+typename OrderedKeyTable<KEY, Columns...>::size_type OrderedKeyTable<KEY, Columns...>::insert(KTYPE key, const Columns&... values)
+{
+	if (count_ == capacity_)
+		realoc(capacity_ ? 2*capacity_ : BASESIZE);
+	if (empty() || key > lastKey_)
+	{
+		keys_.append(count_, key);
+		setValues(count_, values...);
+		if (empty())
+			firstKey_ = key;
+		lastKey_ = key;
+		return count_++;
+	}
+	auto pos = lowerBound(key);
+	if (keyAt(pos) != key)
+	{
+		DWLOG(QString("OKT: Inserting row %1 in the middle is highly discouraged").arg(key));
+		keys_.insertAt(pos, count_, key);
+		moveValues(pos, 1);
+		count_++;
+		if (pos == 0)
+			firstKey_ = key;
+	}
+	setValues(pos, values...);
+	return pos;
+}
+
+template <typename KEY, typename... Columns>
+void OrderedKeyTable<KEY, Columns...>::remove(KTYPE key)
+{
+	auto pos = find(key);
+	if (pos == count_)
+		return;
+	if (pos != count_-1)
+	{
+		DWLOG(QString("OKT: Removing row %1 from the middle is highly discouraged").arg(key));
+	}
+	keys_.removeAt(pos, count_);
+	moveValues(pos+1, -1);
+	if (--count_)
+	{
+		firstKey_ = keyAt(0);
+		lastKey_ = keyAt(count_-1);
+	}
+	else
+		clear();
+}
+
+template <typename KEY, typename... Columns>
+typename OrderedKeyTable<KEY, Columns...>::size_type OrderedKeyTable<KEY, Columns...>::lowerBound(KTYPE key) const
+{
+	if (empty() || key > lastKey_)
+		return count_;
+	if (key == lastKey_)
+		return count_-1;
+	if (key <= firstKey_)
+		return 0;
+	return keys_.lowerBound(key, count_, firstKey_, lastKey_);
+}
+
+template <typename KEY, typename... Columns>
+typename OrderedKeyTable<KEY, Columns...>::size_type OrderedKeyTable<KEY, Columns...>::find(KTYPE key) const
+{
+	auto pos = lowerBound(key);
+	if (pos == count_ || keyAt(pos) == key)
+		return pos;
+	return count_;
+}
+
+} // Smitto::
+
+#ifdef TEMPORATY_DWLOG_DISABLED
+#undef DWLOG
+#undef TEMPORATY_DWLOG_DISABLED
+#endif
@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+#
+# Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+# Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+#
+"""Compares two OrderedKeyMapBench JSON results by median ns/op.
+Exits with 1 when a case is slower than the baseline by more than the threshold."""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {r["name"]: r for r in json.load(f)["results"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=0.10, help="allowed slowdown, 0.10 is 10%%")
+    parser.add_argument("--min-ns", type=float, default=0.5, help="ignore differences below this many ns/op")
+    parser.add_argument("--metric", default="median", choices=["min", "median", "mean"])
+    parser.add_argument("--all", action="store_true", help="print unchanged cases too")
+    args = parser.parse_args()
+
+    base, cur = load(args.baseline), load(args.current)
+    regressions = 0
+    for name in sorted(base.keys() & cur.keys()):
+        b, c = base[name][args.metric], cur[name][args.metric]
+        change = (c - b) / b if b > 0 else 0.0
+        slower = change > args.threshold and c - b > args.min_ns
+        faster = change < -args.threshold and b - c > args.min_ns
+        regressions += slower
+        if slower or faster or args.all:
+            mark = "REGRESSION" if slower else "faster" if faster else ""
+            print(f"{name:48} {b:10.2f} -> {c:10.2f} ns/op {change:+7.1%} {mark}")
+    for name in sorted(base.keys() - cur.keys()):
+        print(f"{name:48} missing in {args.current}")
+    print(f"{len(base.keys() & cur.keys())} cases compared, {regressions} regressions over {args.threshold:.0%}")
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,489 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <smitto/okm.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define OKM_BENCH_JOURNAL
+#include <filesystem>
+#include <smitto/okw.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Qt-free benchmark of OrderedKeyMap over a matrix of key distributions, value sizes, map sizes and operations.
+// Every case is named op/distribution/value/algorithm/size, results go to stdout and optionally to a JSON file
+// that compare.py checks against a baseline.
+
+using Smitto::FindAlgorithm;
+typedef std::uint64_t KeyType;
+
+template <int SIZE>
+struct TestValue
+{
+	std::uint64_t val[SIZE/8];
+	TestValue() = default;
+	TestValue(std::uint64_t pval) {val[0] = pval; for (int i = 1; i < SIZE/8; i++) val[i] = 0;}
+};
+
+template <typename T>
+static inline void keep(const T& v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "r,m"(v) : "memory");
+#else
+	static volatile T sink; sink = v;
+#endif
+}
+
+struct Options
+{
+	std::vector<std::ptrdiff_t> sizes = {1 << 10, 1 << 15, 1 << 20, 1 << 24};
+	int reps = 5;
+	std::uint64_t seed = 20230601;
+	std::ptrdiff_t lookups = 1'000'000;
+	bool perf = false;
+	std::string filter;
+	std::string out;
+};
+
+/// ------------------------------------------------------------------------------------------------
+
+enum class Distribution
+{
+	FixedStep,     // one key every 250 ms
+	TradingHours,  // minute bars from 7:00 to 23:00 on weekdays
+	Uniform,       // sorted unique keys with uniform random gaps
+	Clustered      // dense bursts separated by long pauses
+};
+
+static const char* distributionName(Distribution d)
+{
+	switch (d)
+	{
+		case Distribution::FixedStep: return "fixed";
+		case Distribution::TradingHours: return "hours";
+		case Distribution::Uniform: return "uniform";
+		case Distribution::Clustered: return "clustered";
+	}
+	return "";
+}
+
+static std::vector<KeyType> makeKeys(Distribution d, std::ptrdiff_t count, std::uint64_t seed)
+{
+	std::mt19937_64 rng(seed);
+	std::vector<KeyType> keys;
+	keys.reserve(count);
+	KeyType key = 1'700'000'000'000ull;
+	switch (d)
+	{
+		case Distribution::FixedStep:
+			for (std::ptrdiff_t i = 0; i < count; i++)
+				keys.push_back(key + i*250);
+			break;
+		case Distribution::TradingHours:
+			for (key = 1'700'006'400ull; std::ptrdiff_t(keys.size()) < count; key += 60)
+			{
+				auto tod = key%(3600*24);
+				auto weekday = (key/(3600*24) + 4)%7; // 1970-01-01 is Thursday
+				if (weekday < 5 && tod >= 7*3600 && tod <= 23*3600)
+					keys.push_back(key);
+			}
+			break;
+		case Distribution::Uniform:
+		{
+			std::uniform_int_distribution<KeyType> gap(1, 1999);
+			for (std::ptrdiff_t i = 0; i < count; i++)
+				keys.push_back(key += gap(rng));
+			break;
+		}
+		case Distribution::Clustered:
+		{
+			std::geometric_distribution<int> cluster(1.0/256);
+			std::uniform_int_distribution<KeyType> pause(100'000, 10'000'000);
+			while (std::ptrdiff_t(keys.size()) < count)
+			{
+				key += pause(rng);
+				for (int i = cluster(rng) + 1; i > 0 && std::ptrdiff_t(keys.size()) < count; i--)
+					keys.push_back(++key);
+			}
+			break;
+		}
+	}
+	return keys;
+}
+
+/// ------------------------------------------------------------------------------------------------
+
+// Hardware counters of the calling thread, unavailable counters read as -1.
+class PerfCounters
+{
+public:
+	enum Counter {CacheMisses, BranchMisses, Instructions, CounterCount};
+#ifdef __linux__
+	explicit PerfCounters(bool enabled) {
+		if (!enabled)
+			return;
+		const std::uint64_t configs[CounterCount] = {PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_INSTRUCTIONS};
+		for (int i = 0; i < CounterCount; i++)
+		{
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fds_[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}}
+	~PerfCounters() {for (int fd : fds_) if (fd >= 0) close(fd);}
+	void start() {for (int fd : fds_) if (fd >= 0) {ioctl(fd, PERF_EVENT_IOC_RESET, 0); ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);}}
+	void stop() {
+		for (int i = 0; i < CounterCount; i++)
+			if (fds_[i] >= 0)
+			{
+				ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+				std::uint64_t value = 0;
+				if (read(fds_[i], &value, sizeof(value)) == sizeof(value))
+					total_[i] += value;
+			}}
+	double perOp(Counter c, std::uint64_t ops) const {return fds_[c] >= 0 && ops ? double(total_[c])/ops : -1;}
+	void reset() {for (auto& t : total_) t = 0;}
+private:
+	int fds_[CounterCount] = {-1, -1, -1};
+	std::uint64_t total_[CounterCount] = {};
+#else
+	explicit PerfCounters(bool) {}
+	void start() {}
+	void stop() {}
+	double perOp(Counter, std::uint64_t) const {return -1;}
+	void reset() {}
+#endif
+};
+
+/// ------------------------------------------------------------------------------------------------
+
+struct Result
+{
+	std::string name;
+	std::string operation;
+	const char* distribution;
+	int valueSize;
+	const char* algorithm;
+	std::ptrdiff_t size;
+	std::uint64_t ops;
+	std::vector<double> nsPerOp;
+	double cacheMisses = -1, branchMisses = -1, instructions = -1;
+
+	double min() const {return *std::min_element(nsPerOp.begin(), nsPerOp.end());}
+	double median() const {auto v = nsPerOp; std::sort(v.begin(), v.end()); return v[v.size()/2];}
+	double mean() const {double s = 0; for (auto v : nsPerOp) s += v; return s/nsPerOp.size();}
+};
+
+class Bench
+{
+public:
+	explicit Bench(const Options& options) : options_(options), perf_(options.perf) {}
+
+	// prepare() runs untimed before every repetition, run() is timed and returns a checksum
+	template <typename PREPARE, typename RUN>
+	void measure(Result r, std::uint64_t ops, const PREPARE& prepare, const RUN& run)
+	{
+		r.name = name(r);
+		if (!selected(r))
+			return;
+		r.ops = ops;
+		perf_.reset();
+		for (int rep = 0; rep < options_.reps; rep++)
+		{
+			prepare();
+			perf_.start();
+			auto start = std::chrono::steady_clock::now();
+			keep(run());
+			auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+			perf_.stop();
+			r.nsPerOp.push_back(ns/ops);
+		}
+		std::uint64_t totalOps = ops*options_.reps;
+		r.cacheMisses = perf_.perOp(PerfCounters::CacheMisses, totalOps);
+		r.branchMisses = perf_.perOp(PerfCounters::BranchMisses, totalOps);
+		r.instructions = perf_.perOp(PerfCounters::Instructions, totalOps);
+		printf("%-48s median %10.2f ns/op  min %10.2f", r.name.c_str(), r.median(), r.min());
+		if (r.cacheMisses >= 0)
+			printf("  cache-miss %7.3f  branch-miss %7.3f", r.cacheMisses, r.branchMisses);
+		printf("\n");
+		fflush(stdout);
+		results_.push_back(std::move(r));
+	}
+
+	bool writeJson(const std::string& path) const;
+	const Options& options() const {return options_;}
+	// by --filter, to skip an expensive setup
+	bool selected(const Result& r) const {return options_.filter.empty() || name(r).find(options_.filter) != std::string::npos;}
+	static std::string name(const Result& r) {
+		return r.operation + "/" + r.distribution + "/v" + std::to_string(r.valueSize) + "/" + r.algorithm + "/n" + std::to_string(r.size);}
+
+private:
+	const Options& options_;
+	PerfCounters perf_;
+	std::vector<Result> results_;
+};
+
+static void writeCounter(FILE* f, const char* name, double value)
+{
+	if (value < 0)
+		fprintf(f, ", \"%s\": null", name);
+	else
+		fprintf(f, ", \"%s\": %.4f", name, value);
+}
+
+bool Bench::writeJson(const std::string& path) const
+{
+	FILE* f = fopen(path.c_str(), "w");
+	if (!f)
+		return false;
+	fprintf(f, "{\n  \"seed\": %llu, \"reps\": %d, \"lookups\": %lld,\n  \"results\": [\n",
+			(unsigned long long)options_.seed, options_.reps, (long long)options_.lookups);
+	for (size_t i = 0; i < results_.size(); i++)
+	{
+		const auto& r = results_[i];
+		fprintf(f, "    {\"name\": \"%s\", \"operation\": \"%s\", \"distribution\": \"%s\", \"valueSize\": %d, \"algorithm\": \"%s\", "
+				"\"size\": %lld, \"ops\": %llu, \"min\": %.4f, \"median\": %.4f, \"mean\": %.4f",
+				r.name.c_str(), r.operation.c_str(), r.distribution, r.valueSize, r.algorithm,
+				(long long)r.size, (unsigned long long)r.ops, r.min(), r.median(), r.mean());
+		writeCounter(f, "cacheMisses", r.cacheMisses);
+		writeCounter(f, "branchMisses", r.branchMisses);
+		writeCounter(f, "instructions", r.instructions);
+		fprintf(f, "}%s\n", i + 1 < results_.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	return fclose(f) == 0;
+}
+
+/// ------------------------------------------------------------------------------------------------
+
+template <int VALUESIZE, FindAlgorithm ALGORITHM>
+static void benchMap(Bench& bench, Distribution d, const std::vector<KeyType>& keys)
+{
+	typedef Smitto::OrderedKeyMap<KeyType, TestValue<VALUESIZE>, ALGORITHM> Map;
+	const auto& options = bench.options();
+	const std::ptrdiff_t count = keys.size();
+	Result base;
+	base.distribution = distributionName(d);
+	base.valueSize = VALUESIZE;
+	base.algorithm = ALGORITHM == FindAlgorithm::BinarySeparation ? "binary" : "relative";
+	base.size = count;
+	auto result = [&base](const char* operation) {Result r = base; r.operation = operation; return r;};
+
+	std::unique_ptr<Map> target;
+	bench.measure(result("append"), count, [&]() {target.reset();}, [&]() {
+		target = std::make_unique<Map>();
+		for (std::ptrdiff_t i = 0; i < count; i++)
+			target->insert(keys[i], TestValue<VALUESIZE>(i));
+		return target->count();
+	});
+
+	Map map;
+	for (std::ptrdiff_t i = 0; i < count; i++)
+		map.insert(keys[i], TestValue<VALUESIZE>(i));
+
+	// every 4th key of the last 4096 arrives late, after the newer ones
+	std::vector<KeyType> late;
+	Map early;
+	for (std::ptrdiff_t i = 0; i < count; i++)
+		if (i >= count - 4096 && i%4 == 1)
+			late.push_back(keys[i]);
+		else
+			early.insert(keys[i], TestValue<VALUESIZE>(i));
+	if (!late.empty())
+		bench.measure(result("lateInsert"), late.size(), [&]() {target.reset(); target = std::make_unique<Map>(early);}, [&]() {
+			for (auto key : late)
+				target->insert(key, TestValue<VALUESIZE>(key));
+			return target->count();
+		});
+	target.reset();
+
+	std::mt19937_64 rng(options.seed);
+	std::uniform_int_distribution<std::ptrdiff_t> anyPos(0, count - 1);
+	std::uniform_int_distribution<KeyType> anyKey(keys.front(), keys.back());
+	std::vector<KeyType> existing(options.lookups), between(options.lookups);
+	for (auto& key : existing)
+		key = keys[anyPos(rng)];
+	for (auto& key : between)
+		key = anyKey(rng);
+
+	auto none = []() {};
+	bench.measure(result("find"), existing.size(), none, [&]() {
+		std::uint64_t sum = 0;
+		for (auto key : existing)
+			sum += map.find(key).value().val[0];
+		return sum;
+	});
+	bench.measure(result("lowerBound"), between.size(), none, [&]() {
+		std::uint64_t sum = 0;
+		for (auto key : between)
+			sum += map.lowerBound(key).pos();
+		return sum;
+	});
+
+	constexpr std::ptrdiff_t scanLength = 64;
+	std::ptrdiff_t scans = std::max<std::ptrdiff_t>(1, options.lookups/scanLength);
+	bench.measure(result("rangeScan"), scans, none, [&]() {
+		std::uint64_t sum = 0;
+		for (std::ptrdiff_t i = 0; i < scans; i++)
+		{
+			auto it = map.lowerBound(between[i]);
+			auto end = map.begin() + std::min(it.pos() + scanLength, map.count());
+			for (; it != end; ++it)
+				sum += it->val[0];
+		}
+		return sum;
+	});
+
+	bench.measure(result("iteration"), count, none, [&]() {
+		std::uint64_t sum = 0;
+		for (const auto& value : map)
+			sum += value.val[0];
+		return sum;
+	});
+}
+
+#ifdef OKM_BENCH_JOURNAL
+// Recovery of a map journaled from scratch: the newest snapshot holds all but the last 1% of the records,
+// those are replayed from the journal. The files are in the page cache.
+template <int VALUESIZE>
+static void benchRecover(Bench& bench, Distribution d, const std::vector<KeyType>& keys)
+{
+	typedef Smitto::OrderedKeyMap<KeyType, TestValue<VALUESIZE>> Map;
+	typedef Smitto::OrderedKeyJournal<Map> Journal;
+	const std::ptrdiff_t count = keys.size();
+	Result r;
+	r.operation = "recover";
+	r.distribution = distributionName(d);
+	r.valueSize = VALUESIZE;
+	r.algorithm = "binary";
+	r.size = count;
+	if (!bench.selected(r))
+		return;
+	auto dir = (std::filesystem::temp_directory_path() / "OrderedKeyMapBench.journal").string();
+	std::filesystem::remove_all(dir);
+	{
+		Map map;
+		typename Journal::Options options;
+		options.fsync = false;
+		Journal journal(dir, map, options);
+		std::ptrdiff_t tail = count - count/100;
+		for (std::ptrdiff_t i = 0; i < tail; i++)
+			journal.insert(keys[i], TestValue<VALUESIZE>(i));
+		// both snapshot files, so the journal before them is removed
+		journal.snapshot();
+		journal.snapshot();
+		for (std::ptrdiff_t i = tail; i < count; i++)
+			journal.insert(keys[i], TestValue<VALUESIZE>(i));
+		journal.sync();
+	}
+	std::unique_ptr<Map> target;
+	bench.measure(r, count, [&]() {target.reset(); target = std::make_unique<Map>(0);}, [&]() {
+		Journal::recover(dir, *target);
+		return target->count();
+	});
+	std::filesystem::remove_all(dir);
+}
+#endif
+
+template <int VALUESIZE>
+static void benchValue(Bench& bench, Distribution d, const std::vector<KeyType>& keys)
+{
+	benchMap<VALUESIZE, FindAlgorithm::BinarySeparation>(bench, d, keys);
+	benchMap<VALUESIZE, FindAlgorithm::RelativePrediction>(bench, d, keys);
+}
+
+static void usage()
+{
+	printf("OrderedKeyMapBench [--quick] [--huge] [--sizes n,n,...] [--reps n] [--lookups n] [--seed n]\n"
+		   "                   [--filter substring] [--perf] [--out file.json]\n"
+		   "  --quick   small sizes and few lookups, for smoke tests\n"
+		   "  --huge    add a 100M keys map (needs about 8 GB for the 64 byte values)\n"
+		   "  --perf    collect cache and branch misses with perf_event (Linux)\n");
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		auto next = [&]() -> std::string {return i + 1 < argc ? argv[++i] : "";};
+		if (arg == "--quick")
+		{
+			options.sizes = {1 << 10, 1 << 14};
+			options.reps = 3;
+			options.lookups = 10'000;
+		}
+		else if (arg == "--huge")
+			options.sizes.push_back(100'000'000);
+		else if (arg == "--sizes")
+		{
+			options.sizes.clear();
+			std::stringstream list(next());
+			for (std::string size; std::getline(list, size, ',');)
+				options.sizes.push_back(std::stoll(size));
+		}
+		else if (arg == "--reps")
+			options.reps = std::max(1, std::stoi(next()));
+		else if (arg == "--lookups")
+			options.lookups = std::max(1ll, std::stoll(next()));
+		else if (arg == "--seed")
+			options.seed = std::stoull(next());
+		else if (arg == "--filter")
+			options.filter = next();
+		else if (arg == "--perf")
+			options.perf = true;
+		else if (arg == "--out")
+			options.out = next();
+		else
+		{
+			usage();
+			return arg == "--help" ? 0 : 1;
+		}
+	}
+
+	Bench bench(options);
+	for (auto size : options.sizes)
+		for (auto d : {Distribution::FixedStep, Distribution::TradingHours, Distribution::Uniform, Distribution::Clustered})
+		{
+			auto keys = makeKeys(d, size, options.seed);
+#ifdef OKM_BENCH_JOURNAL
+			if (d == Distribution::FixedStep)
+				benchRecover<8>(bench, d, keys);
+#endif
+			benchValue<8>(bench, d, keys);
+			benchValue<24>(bench, d, keys);
+			benchValue<64>(bench, d, keys);
+		}
+
+	if (!options.out.empty() && !bench.writeJson(options.out))
+	{
+		fprintf(stderr, "Can't write %s\n", options.out.c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,13 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// assert() that stays in release builds
+#define CHECK(cond) do { if (!(cond)) { \
+	std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); std::exit(1);} } while (0)
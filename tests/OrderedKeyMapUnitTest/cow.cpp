@@ -0,0 +1,199 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <cstdint>
+#include <utility>
+#include <smitto/okm.h>
+#include "check.h"
+
+using Map = Smitto::OrderedKeyMap<std::int64_t, std::int64_t, Smitto::FindAlgorithm::BinarySeparation, Smitto::CopyMode::OnWrite>;
+
+static Map filled(std::int64_t n)
+{
+	Map res(16);
+	for (std::int64_t i = 0; i < n; i++)
+		res.insert(i*10, i);
+	return res;
+}
+
+static bool unchanged(const Map& m, std::int64_t n)
+{
+	if (m.count() != n || m.firstKey() != 0 || m.lastKey() != (n-1)*10)
+		return false;
+	for (std::int64_t i = 0; i < n; i++)
+		if (m.dataAt(i).key != i*10 || m.dataAt(i).value != i)
+			return false;
+	return true;
+}
+
+static void sharing()
+{
+	Map a = filled(8);
+	Map b = a;
+	CHECK(b.isSharedWith(a) && !a.isDetached() && !b.isDetached());
+	CHECK(unchanged(b, 8));
+	Map c;
+	c = b;
+	CHECK(c.isSharedWith(a));
+	// const access keeps the buffer shared
+	std::int64_t sum = 0;
+	for (auto v : std::as_const(c))
+		sum += v;
+	CHECK(sum == 28 && std::as_const(c).find(30).value() == 3 && std::as_const(c).lowerBound(31).key() == 40);
+	CHECK(std::as_const(c)[70] == 7 && c.value(20) == 2 && c.contains(50));
+	CHECK(c.isSharedWith(a));
+}
+
+static void tailOwnerAppend()
+{
+	Map a = filled(8);
+	Map b = a;
+	// the first map to append owns the tail and writes in place
+	b.insert(80, 8);
+	CHECK(b.isSharedWith(a) && b.count() == 9 && b.lastKey() == 80);
+	CHECK(unchanged(a, 8));
+	std::int64_t keys[] = {90, 100}, values[] = {9, 10};
+	CHECK(b.appendBulk(keys, values, 2));
+	b.emplace(110, 11);
+	CHECK(b.isSharedWith(a) && unchanged(a, 8) && b.count() == 12);
+	// the other map can not append in place any more
+	a.insert(85, -1);
+	CHECK(!a.isSharedWith(b) && a.isDetached() && b.isDetached());
+	CHECK(a.count() == 9 && a.lastKey() == 85 && a.last() == -1);
+	CHECK(b.count() == 12 && b.value(80) == 8 && !b.contains(85));
+}
+
+static void otherDetaches()
+{
+	Map a = filled(8);
+	Map b = a;
+	b.detach();
+	CHECK(!b.isSharedWith(a) && a.isDetached() && b.isDetached());
+	b[30] = -3;
+	CHECK(unchanged(a, 8) && b.value(30) == -3);
+	// the remaining owner writes in place once alone
+	auto data = a.pairs().data();
+	a[30] = 33;
+	CHECK(a.pairs().data() == data && a.value(30) == 33 && b.value(30) == -3);
+}
+
+static void middleWrites()
+{
+	Map a = filled(8);
+	{
+		Map b = a;
+		b[30] = -1;
+		CHECK(!b.isSharedWith(a) && unchanged(a, 8) && b.value(30) == -1);
+	}
+	{
+		Map b = a;
+		b.insert(35, -1);
+		CHECK(!b.isSharedWith(a) && unchanged(a, 8) && b.count() == 9);
+	}
+	{
+		Map b = a;
+		b.insert(30, -1);
+		CHECK(!b.isSharedWith(a) && unchanged(a, 8) && b.value(30) == -1);
+	}
+	{
+		Map b = a;
+		b.remove(30);
+		CHECK(!b.isSharedWith(a) && unchanged(a, 8) && b.count() == 7 && !b.contains(30));
+	}
+	{
+		Map b = a;
+		b.first() = -1;
+		b.last() = -2;
+		CHECK(unchanged(a, 8) && b.value(0) == -1 && b.value(70) == -2);
+	}
+	{
+		Map b = a;
+		b.remove(70);
+		b.trimAfter(40);
+		CHECK(unchanged(a, 8) && b.count() == 5 && b.lastKey() == 40);
+		b.insert(50, -5);
+		CHECK(unchanged(a, 8) && b.value(50) == -5);
+	}
+}
+
+static void iteratorWrites()
+{
+	Map a = filled(8);
+	{
+		Map b = a;
+		for (auto& v : b)
+			v = 0;
+		CHECK(unchanged(a, 8) && b.count() == 8 && b.value(70) == 0);
+	}
+	{
+		Map b = a;
+		*b.find(20) = -1;
+		CHECK(unchanged(a, 8) && b.value(20) == -1);
+	}
+	{
+		Map b = a;
+		b.lowerBound(21).value() = -1;
+		b.upperBound(50).value() = -2;
+		CHECK(unchanged(a, 8) && b.value(30) == -1 && b.value(60) == -2);
+	}
+	{
+		Map b = a;
+		b.at(2).value() = -1;
+		b.dataAt(3).value = -2;
+		b.begin()[4] = -3;
+		CHECK(unchanged(a, 8) && b.value(20) == -1 && b.value(30) == -2 && b.value(40) == -3);
+	}
+	{
+		Map b = a;
+		for (auto& pair : b.pairs())
+			pair.value = 0;
+		for (auto& v : b.valuesView())
+			v++;
+		CHECK(unchanged(a, 8) && b.value(70) == 1);
+	}
+	{
+		// an iterator taken from the shared buffer and made mutable after the detach still points at the same position
+		Map b = a;
+		auto it = b.end() - 1;
+		*it = -7;
+		CHECK(unchanged(a, 8) && b.last() == -7 && it.key() == 70);
+	}
+}
+
+// valueNearPos() walks from the hint towards the key and stays inside the map
+static void nearPositions()
+{
+	Map a = filled(16);
+	const Map& c = a;
+	CHECK(c.valueNearPos(50, 5) == 5 && c.valueNearPos(70, 5) == 7 && c.valueNearPos(20, 5) == 2);
+	CHECK(c.valueNearPos(150, 0) == 15 && c.valueNearPos(0, 15) == 0);
+	// missing keys between, before and after the keys, and a hint outside of the map
+	CHECK(c.valueNearPos(55, 2) == 0 && c.valueNearPos(-10, 3) == 0 && c.valueNearPos(160, 12) == 0);
+	CHECK(c.valueNearPos(-10, 0) == 0 && c.valueNearPos(500, 15) == 0 && c.valueNearPos(50, 16) == 0);
+
+	Map b = a;
+	b.valueNearPos(30, 6) = -3;
+	CHECK(unchanged(a, 16) && b.value(30) == -3 && !b.isSharedWith(a));
+	Map d = a;
+	d.valueNearPos(35, 6);
+	CHECK(d.isSharedWith(a));
+
+	Smitto::OrderedKeyMap<std::uint32_t, int> u;
+	for (std::uint32_t k = 1; k < 10; k++)
+		u.insert(k*10, int(k));
+	CHECK(std::as_const(u).valueNearPos(20, 5) == 2 && std::as_const(u).valueNearPos(80, 5) == 8);
+	CHECK(std::as_const(u).valueNearPos(5, 5) == 0 && std::as_const(u).valueNearPos(25, 5) == 0);
+}
+
+int main()
+{
+	sharing();
+	tailOwnerAppend();
+	otherDetaches();
+	middleWrites();
+	iteratorWrites();
+	nearPositions();
+	return 0;
+}
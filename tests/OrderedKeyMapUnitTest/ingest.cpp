@@ -0,0 +1,48 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <cstdint>
+#include <smitto/okm.h>
+#include <smitto/oki.h>
+#include "check.h"
+
+using namespace Smitto;
+
+using Map = OrderedKeyMap<std::int64_t, std::int64_t, FindAlgorithm::BinarySeparation, CopyMode::Deep, StatsMode::Local>;
+using Ingest = OrderedKeyMapIngest<Map>;
+
+static void checkMap(const Map& map, std::int64_t count)
+{
+	CHECK(map.count() == count);
+	for (std::int64_t pos = 0; pos < map.count(); pos++)
+		CHECK(map.keyAt(pos) == pos && map.dataAt(pos).value == pos*2);
+}
+
+int main()
+{
+	Map map;
+	Ingest ingest(8);
+	for (std::int64_t key = 0; key < 16; key += 2)
+		ingest.push(key, key*2);
+	CHECK(ingest.drain(map) == 8);
+	CHECK(map.count() == 8 && map.stats().middleInserts == 0);
+
+	// an ordered batch that starts with keys before lastKey(): only those are middle inserts
+	for (std::int64_t key = 1; key < 16; key += 2)
+		ingest.push(key, key*2);
+	CHECK(ingest.drain(map) == 8);
+	CHECK(map.count() == 16 && map.stats().middleInserts == 7);
+	for (std::int64_t key = 16; key < 24; key++)
+		ingest.push(key, key*2);
+	ingest.drain(map);
+	checkMap(map, 24);
+
+	// an unordered batch is inserted key by key
+	for (std::int64_t key : {31, 24, 30, 25, 29, 26, 28, 27})
+		ingest.push(key, key*2);
+	CHECK(ingest.drain(map) == 8);
+	checkMap(map, 32);
+	return 0;
+}
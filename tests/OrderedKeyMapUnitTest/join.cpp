@@ -0,0 +1,143 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+#include <smitto/okm.h>
+#include <smitto/okt.h>
+#include <smitto/okj.h>
+#include "check.h"
+
+using namespace Smitto;
+
+typedef OrderedKeyMap<std::int64_t, std::int32_t> Map;
+typedef OrderedKeyTable<std::int64_t, double> Table;
+
+// the joins as the obvious quadratic loops over the keys
+
+static std::vector<std::ptrdiff_t> bruteAsOf(const std::vector<std::int64_t>& left, const std::vector<std::int64_t>& right,
+		std::int64_t tolerance)
+{
+	std::vector<std::ptrdiff_t> res;
+	for (auto key : left)
+	{
+		std::ptrdiff_t match = JoinNoMatch;
+		for (std::ptrdiff_t j = 0; j < std::ptrdiff_t(right.size()); j++)
+			if (right[j] <= key)
+				match = j;
+		res.push_back(match != JoinNoMatch && key - right[match] <= tolerance ? match : JoinNoMatch);
+	}
+	return res;
+}
+
+static std::vector<JoinPositions> bruteInner(const std::vector<std::int64_t>& left, const std::vector<std::int64_t>& right)
+{
+	std::vector<JoinPositions> res;
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(left.size()); i++)
+		for (std::ptrdiff_t j = 0; j < std::ptrdiff_t(right.size()); j++)
+			if (left[i] == right[j])
+				res.push_back({i, j});
+	return res;
+}
+
+static std::vector<JoinPositions> bruteOuter(const std::vector<std::int64_t>& left, const std::vector<std::int64_t>& right)
+{
+	std::vector<JoinPositions> res;
+	std::ptrdiff_t i = 0, j = 0, lcount = left.size(), rcount = right.size();
+	while (i < lcount || j < rcount)
+	{
+		if (j == rcount || (i < lcount && left[i] < right[j]))
+			res.push_back({i++, JoinNoMatch});
+		else if (i == lcount || right[j] < left[i])
+			res.push_back({JoinNoMatch, j++});
+		else
+			res.push_back({i++, j++});
+	}
+	return res;
+}
+
+static std::vector<std::int64_t> randomKeys(std::mt19937_64& rnd, int count, std::int64_t range)
+{
+	Map map;
+	while (map.count() < count)
+		map.insert(std::int64_t(rnd() % range) - range/2, 0);
+	return std::vector<std::int64_t>(map.keysView().begin(), map.keysView().end());
+}
+
+static void compare(const std::vector<std::int64_t>& lkeys, const std::vector<std::int64_t>& rkeys)
+{
+	Map left, right;
+	Table table;
+	for (auto key : lkeys)
+		left.insert(key, std::int32_t(key % 1000));
+	for (auto key : rkeys)
+	{
+		right.insert(key, std::int32_t(key % 1000));
+		table.append(key, double(key));
+	}
+	auto inner = bruteInner(lkeys, rkeys);
+	auto outer = bruteOuter(lkeys, rkeys);
+	std::vector<std::int64_t> tolerances = {0, 1, 2, 5, 100, std::numeric_limits<std::int64_t>::max()};
+	for (auto tolerance : tolerances)
+	{
+		auto asOf = bruteAsOf(lkeys, rkeys, tolerance);
+		for (int threads : {1, 2, 3, 8})
+		{
+			CHECK(asOfJoin(left, right, tolerance, threads) == asOf);
+			CHECK(asOfJoin(left, table, tolerance, threads) == asOf);
+			auto values = asOfJoinValues(left, right, tolerance, threads);
+			std::ptrdiff_t matched = 0;
+			for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(lkeys.size()); i++)
+			{
+				if (asOf[i] == JoinNoMatch)
+				{
+					CHECK(!values.contains(lkeys[i]));
+					continue;
+				}
+				CHECK(values.value(lkeys[i]) == right.dataAt(asOf[i]).value);
+				matched++;
+			}
+			CHECK(values.count() == matched);
+		}
+	}
+	for (int threads : {1, 2, 3, 8})
+	{
+		CHECK(innerJoin(left, right, threads) == inner && innerJoin(left, table, threads) == inner);
+		CHECK(outerJoin(left, right, threads) == outer && outerJoin(left, table, threads) == outer);
+	}
+}
+
+int main()
+{
+	std::mt19937_64 rnd(29);
+	for (int round = 0; round < 30; round++)
+	{
+		// dense ranges share many keys, sparse ones few
+		std::int64_t range = round % 2 ? 400 : 40'000;
+		compare(randomKeys(rnd, 1 + rnd() % 300, range), randomKeys(rnd, 1 + rnd() % 300, range));
+	}
+	// an empty side
+	auto some = randomKeys(rnd, 100, 1000);
+	compare({}, some);
+	compare(some, {});
+	compare({}, {});
+	// one side entirely before or after the other
+	compare({1, 2, 3}, {10, 20, 30});
+	compare({10, 20, 30}, {1, 2, 3});
+	// tolerance edges: a match exactly tolerance old, one a key older
+	std::vector<std::int64_t> left = {10, 20, 30, 40}, right = {5, 18, 30};
+	Map l, r;
+	for (auto key : left)
+		l.insert(key, 0);
+	for (auto key : right)
+		r.insert(key, 0);
+	CHECK(asOfJoin(l, r, std::int64_t(0)) == (std::vector<std::ptrdiff_t>{JoinNoMatch, JoinNoMatch, 2, JoinNoMatch}));
+	CHECK(asOfJoin(l, r, std::int64_t(2)) == (std::vector<std::ptrdiff_t>{JoinNoMatch, 1, 2, JoinNoMatch}));
+	CHECK(asOfJoin(l, r, std::int64_t(5)) == (std::vector<std::ptrdiff_t>{0, 1, 2, JoinNoMatch}));
+	CHECK(asOfJoin(l, r, std::int64_t(10)) == (std::vector<std::ptrdiff_t>{0, 1, 2, 2}));
+	return 0;
+}
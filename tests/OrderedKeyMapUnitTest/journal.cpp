@@ -0,0 +1,181 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <smitto/okm.h>
+#include <smitto/okw.h>
+#include "check.h"
+
+using namespace Smitto;
+typedef std::map<std::int64_t, std::int64_t> Expected;
+
+template <typename MAP>
+static bool same(const MAP& map, const Expected& expected)
+{
+	if (map.count() != std::ptrdiff_t(expected.size()))
+		return false;
+	auto it = map.constBegin();
+	for (auto& [key, value] : expected)
+	{
+		if (it.key() != key || it.value() != value)
+			return false;
+		++it;
+	}
+	return true;
+}
+
+static std::string lastSegment(const std::string& dir)
+{
+	std::string res;
+	for (auto& entry : std::filesystem::directory_iterator(dir))
+	{
+		auto name = entry.path().filename().string();
+		if (name.rfind("journal.", 0) == 0 && name > res)
+			res = name;
+	}
+	return dir + "/" + res;
+}
+
+// What a crash in the middle of rewriting a snapshot leaves: the header is already invalidated,
+// some of the pages are new.
+static void invalidateSnapshot(const std::string& path)
+{
+	std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+	std::vector<char> zeros(64, 0), garbage(100, 'x');
+	f.write(zeros.data(), zeros.size());
+	f.seekp(4096 + 16);
+	f.write(garbage.data(), garbage.size());
+}
+
+template <typename MAP>
+static void scenario(const std::string& dir)
+{
+	typedef OrderedKeyJournal<MAP> Journal;
+	std::filesystem::remove_all(dir);
+	typename Journal::Options options;
+	options.fsync = false;
+	options.batchRecords = 100;
+	Expected expected;
+	std::uint64_t seq = 0;
+	{
+		MAP map;
+		Journal journal(dir, map, options);
+		CHECK(journal.isOpen() && map.isEmpty() && journal.seq() == 0);
+		auto insert = [&](std::int64_t key, std::int64_t value) {journal.insert(key, value); expected[key] = value;};
+		auto remove = [&](std::int64_t key) {journal.remove(key); expected.erase(key);};
+		for (std::int64_t i = 0; i < 10'000; i++)
+			insert(i*10, i);
+		journal.snapshot(); // snapshot.0, whole
+		// the older snapshot is rewritten from the first changed page
+		for (std::int64_t i = 10'000; i < 12'000; i++)
+			insert(i*10, i);
+		for (std::int64_t i = 0; i < 100; i++)
+			insert(50'000 + i*10 + 5, -i);
+		for (std::int64_t i = 0; i < 100; i++)
+			remove(60'000 + i*30);
+		journal.snapshot(); // snapshot.1
+		// the tail after the newest snapshot
+		for (std::int64_t i = 12'000; i < 13'000; i++)
+			insert(i*10, i);
+		for (std::int64_t i = 0; i < 50; i++)
+		{
+			insert(i*100 + 3, i);
+			remove(90'000 + i*10);
+			insert(1000 + i*10, -1);
+		}
+		journal.sync();
+		CHECK(!journal.failed() && journal.durableSeq() == journal.seq());
+		CHECK(same(map, expected));
+		seq = journal.seq();
+	}
+
+	// the newest snapshot and the journal after it
+	{
+		MAP map;
+		CHECK(Journal::recover(dir, map) == seq && same(map, expected));
+	}
+
+	// the newest snapshot was being rewritten: the older one and a longer replay
+	{
+		std::string copy = dir + ".invalid";
+		std::filesystem::remove_all(copy);
+		std::filesystem::copy(dir, copy);
+		invalidateSnapshot(copy + "/snapshot.1");
+		MAP map;
+		CHECK(Journal::recover(copy, map) == seq && same(map, expected));
+		std::filesystem::remove_all(copy);
+	}
+
+	// a torn last batch is dropped, the journal goes on from the batch before it
+	{
+		MAP map;
+		Journal journal(dir, map, options);
+		CHECK(journal.seq() == seq && same(map, expected));
+		for (std::int64_t i = 0; i < 10; i++)
+			journal.insert(200'000 + i, i);
+		journal.sync();
+		CHECK(journal.seq() == seq + 10);
+	}
+	auto segment = lastSegment(dir);
+	std::filesystem::resize_file(segment, std::filesystem::file_size(segment) - 10);
+	{
+		MAP map;
+		CHECK(Journal::recover(dir, map) == seq && same(map, expected));
+		Journal journal(dir, map, options);
+		CHECK(journal.seq() == seq && same(map, expected));
+		journal.insert(300'000, 1);
+		expected[300'000] = 1;
+		journal.remove(0);
+		expected.erase(0);
+		journal.snapshot();
+		journal.insert(300'001, 2);
+		expected[300'001] = 2;
+	}
+	{
+		MAP map;
+		CHECK(Journal::recover(dir, map) == seq + 3 && same(map, expected));
+	}
+	std::filesystem::remove_all(dir);
+}
+
+// With CopyMode::OnWrite only a remove that shifts pairs copies a buffer shared with a snapshot image
+static void sharedRemoves(const std::string& dir)
+{
+	typedef OrderedKeyMap<std::int64_t, std::int64_t, FindAlgorithm::BinarySeparation, CopyMode::OnWrite> Map;
+	std::filesystem::remove_all(dir);
+	OrderedKeyJournal<Map>::Options options;
+	options.fsync = false;
+	{
+		Map map;
+		OrderedKeyJournal<Map> journal(dir, map, options);
+		for (std::int64_t i = 0; i < 100; i++)
+			journal.insert(i*10, i);
+		Map image = map;
+		journal.remove(55);
+		journal.remove(1000);
+		CHECK(map.isSharedWith(image) && map.count() == 100);
+		journal.remove(990);
+		CHECK(map.isSharedWith(image) && map.count() == 99 && image.count() == 100);
+		journal.remove(500);
+		CHECK(!map.isSharedWith(image) && map.count() == 98 && image.value(500) == 50);
+	}
+	Map map;
+	CHECK(OrderedKeyJournal<Map>::recover(dir, map) == 102 && map.count() == 98 && !map.contains(990) && !map.contains(500));
+	std::filesystem::remove_all(dir);
+}
+
+int main(int argc, char* argv[])
+{
+	std::string dir = argc > 1 ? argv[1] : "journal_test";
+	scenario<OrderedKeyMap<std::int64_t, std::int64_t>>(dir);
+	scenario<OrderedKeyMap<std::int64_t, std::int64_t, FindAlgorithm::BinarySeparation, CopyMode::OnWrite>>(dir);
+	sharedRemoves(dir);
+	return 0;
+}
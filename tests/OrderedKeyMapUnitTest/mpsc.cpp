@@ -0,0 +1,125 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <smitto/okm.h>
+#include <smitto/oki.h>
+#include "check.h"
+
+using Map = Smitto::OrderedKeyMap<std::int64_t, std::int64_t>;
+using Ingest = Smitto::OrderedKeyMapMpscIngest<Map>;
+
+constexpr int producers = 4;
+constexpr std::int64_t perProducer = 50'000;
+constexpr std::int64_t repeatEvery = 10;
+
+static void ring()
+{
+	Smitto::SpscRing<int> ring(5);
+	CHECK(ring.capacity() == 8 && ring.size() == 0);
+	for (int i = 0; i < 8; i++)
+		CHECK(ring.tryPush(int(i)));
+	CHECK(!ring.tryPush(8) && ring.size() == 8);
+	int next = 0;
+	CHECK(ring.popBulk([&next](int& v) {CHECK(v == next++);}, 3) == 3 && ring.size() == 5);
+	CHECK(ring.tryPush(8) && ring.pushed() == 9);
+	// the consumer reads the tail again only when its cached one is used up
+	CHECK(ring.popBulk([&next](int& v) {CHECK(v == next++);}, 100) == 5);
+	CHECK(ring.popBulk([&next](int& v) {CHECK(v == next++);}, 100) == 1 && ring.size() == 0 && next == 9);
+}
+
+// Producer p pushes the keys i*producers+p in order, every repeatEvery-th key twice with a different value.
+// The producers run at their own pace, so keys of a slow producer arrive late and take the insert path.
+static void producersAndOwner()
+{
+	Map map;
+	Ingest ingest(256, producers);
+	std::atomic<int> running{producers};
+	std::vector<Ingest::Producer> handles;
+	for (int p = 0; p < producers; p++)
+	{
+		handles.push_back(ingest.producer());
+		CHECK(handles.back().isValid());
+	}
+	// no ring is left for one more producer
+	CHECK(!ingest.producer().isValid());
+	std::vector<std::thread> threads;
+	for (int p = 0; p < producers; p++)
+		threads.emplace_back([&running, producer = std::move(handles[p]), p]() mutable {
+			for (std::int64_t i = 0; i < perProducer; i++)
+			{
+				std::int64_t key = i*producers + p;
+				producer.push(key, key*2);
+				if (i % repeatEvery == 0)
+				{
+					while (!producer.tryPush(key, key*2 + 1))
+						std::this_thread::yield();
+				}
+			}
+			running.fetch_sub(1);
+		});
+
+	std::int64_t taken = 0;
+	for (bool done = false; !done;)
+	{
+		done = running.load() == 0;
+		taken += ingest.drain(map);
+		for (std::int64_t i = 1; i < map.count(); i++)
+			CHECK(map.keyAt(i-1) < map.keyAt(i));
+	}
+	for (auto& thread : threads)
+		thread.join();
+	taken += ingest.drain(map);
+
+	const std::int64_t repeats = (perProducer + repeatEvery - 1)/repeatEvery;
+	CHECK(taken == producers*(perProducer + repeats));
+	CHECK(map.count() == producers*perProducer && map.firstKey() == 0 && map.lastKey() == producers*perProducer - 1);
+	for (std::int64_t pos = 0; pos < map.count(); pos++)
+	{
+		std::int64_t key = map.keyAt(pos);
+		CHECK(key == pos);
+		CHECK(map.dataAt(pos).value == key*2 + (key/producers % repeatEvery == 0 ? 1 : 0));
+	}
+	auto metrics = ingest.metrics();
+	CHECK(metrics.pushed == std::uint64_t(taken) && metrics.drained == std::uint64_t(taken) && metrics.depth == 0);
+	CHECK(metrics.maxDepth <= std::uint64_t(producers*256));
+
+	// rings of finished producers are handed to new ones
+	handles.clear();
+	CHECK(ingest.producer().isValid());
+}
+
+// an offset encoded map refuses keys out of its range, the keys around them are still stored
+static void narrowKeys()
+{
+	using NarrowMap = Smitto::OrderedKeyMap<std::int64_t, std::int64_t, Smitto::FindAlgorithm::BinarySeparation,
+			Smitto::CopyMode::Deep, Smitto::StatsMode::None, Smitto::KeyEncoding::Offset32>;
+	const std::int64_t base = 1'700'000'000'000'000'000, far = base + (std::int64_t(1) << 33);
+	NarrowMap map;
+	Smitto::OrderedKeyMapMpscIngest<NarrowMap> ingest(64, 1);
+	auto producer = ingest.producer();
+	producer.push(base, 1);
+	CHECK(ingest.drain(map) == 1 && map.count() == 1);
+	producer.push(base + 10, 2);
+	producer.push(far, 3);
+	CHECK(ingest.drain(map) == 2 && map.count() == 2 && map.value(base + 10) == 2 && !map.contains(far));
+	// a late key, one that fits and one that does not
+	producer.push(base + 5, 4);
+	producer.push(base + 20, 5);
+	producer.push(far + 1, 6);
+	CHECK(ingest.drain(map) == 3 && map.count() == 4 && map.value(base + 5) == 4 && map.value(base + 20) == 5);
+	CHECK(map.lastKey() == base + 20);
+}
+
+int main()
+{
+	ring();
+	producersAndOwner();
+	narrowKeys();
+	return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <utility>
+#include <vector>
+#include <smitto/okm.h>
+#include <smitto/okj.h>
+#include "check.h"
+
+using namespace Smitto;
+
+template <KeyEncoding KEYENCODING, FindAlgorithm FINDALGORITHM = FindAlgorithm::BinarySeparation,
+		  CopyMode COPYMODE = CopyMode::Deep>
+using Map = OrderedKeyMap<std::int64_t, std::int32_t, FINDALGORITHM, COPYMODE, StatsMode::None, KEYENCODING>;
+
+static_assert(sizeof(Map<KeyEncoding::Offset32>::Pair) == 8 && sizeof(Map<KeyEncoding::Full>::Pair) == 16);
+static_assert(sizeof(Map<KeyEncoding::Offset16>::Pair) == 8); // the value is wider than the key
+// the pair array does not hold the keys
+template <typename MAP>
+concept RawData = requires(const MAP& m, const char* raw) {m.data(); MAP::fromRawData(raw, 0);};
+static_assert(RawData<Map<KeyEncoding::Full>> && !RawData<Map<KeyEncoding::Offset32>>);
+static_assert(!std::is_constructible_v<Map<KeyEncoding::Offset32>, const void*, std::ptrdiff_t>);
+
+template <typename NARROW, typename PLAIN>
+static void sameContent(const NARROW& narrow, const PLAIN& plain)
+{
+	CHECK(narrow.count() == plain.count() && narrow.firstKey() == plain.firstKey() && narrow.lastKey() == plain.lastKey());
+	auto it = plain.constBegin();
+	for (auto nit = narrow.constBegin(); nit != narrow.constEnd(); ++nit, ++it)
+		CHECK(nit.key() == it.key() && nit.value() == it.value());
+	std::ptrdiff_t pos = 0;
+	for (auto key : narrow.keysView())
+		CHECK(key == plain.keyAt(pos) && key == narrow.keyAt(pos++));
+}
+
+template <typename NARROW, typename PLAIN>
+static void sameLookups(const NARROW& narrow, const PLAIN& plain, const std::vector<std::int64_t>& probes)
+{
+	sameContent(narrow, plain);
+	for (auto key : probes)
+	{
+		auto a = narrow.lowerBound(key);
+		auto b = plain.lowerBound(key);
+		CHECK(a.pos() == b.pos() && a.key() == b.key());
+		CHECK(narrow.upperBound(key).pos() == plain.upperBound(key).pos());
+		CHECK(narrow.upperBoundAlt(key).pos() == plain.upperBoundAlt(key).pos());
+		CHECK(narrow.find(key).pos() == plain.find(key).pos());
+		CHECK(narrow.findAlt(key).pos() == plain.findAlt(key).pos());
+		CHECK(narrow.contains(key) == plain.contains(key) && narrow.value(key) == plain.value(key));
+	}
+}
+
+// nanosecond timestamps a few microseconds apart, spanning about a second
+template <KeyEncoding KEYENCODING, FindAlgorithm FINDALGORITHM>
+static void lookups()
+{
+	std::mt19937_64 rng(7);
+	const std::int64_t start = 1'700'000'000'000'000'000;
+	Map<KEYENCODING, FINDALGORITHM> narrow(16);
+	Map<KeyEncoding::Full, FINDALGORITHM> plain(16);
+	std::vector<std::int64_t> probes;
+	std::int64_t key = start;
+	std::int64_t step = KEYENCODING == KeyEncoding::Offset16 ? 20 : 5000;
+	for (int i = 0; i < 100'000 && key - start < std::numeric_limits<typename Map<KEYENCODING>::stored_key_type>::max(); i++)
+	{
+		key += 1 + rng() % step;
+		narrow.insert(key, i);
+		plain.insert(key, i);
+		probes.push_back(key);
+		probes.push_back(key - 1);
+	}
+	probes.push_back(start);
+	probes.push_back(key + 1);
+	CHECK(narrow.count() > 1000 && narrow.keyBase() == narrow.firstKey());
+	sameLookups(narrow, plain, probes);
+
+	// middle inserts and removes
+	for (int i = 0; i < 200; i++)
+	{
+		auto k = plain.keyAt(rng() % plain.count()) + 1;
+		narrow.insert(k, -i);
+		plain.insert(k, -i);
+		auto r = plain.keyAt(rng() % plain.count());
+		narrow.remove(r);
+		plain.remove(r);
+	}
+	narrow.remove(narrow.firstKey());
+	plain.remove(plain.firstKey());
+	sameLookups(narrow, plain, probes);
+}
+
+static void rebase()
+{
+	Map<KeyEncoding::Offset16> narrow;
+	Map<KeyEncoding::Full> plain;
+	for (std::int64_t k = 1000; k < 2000; k += 10)
+	{
+		narrow.insert(k, int(k));
+		plain.insert(k, int(k));
+	}
+	// keys below the base move it down and re-encode the offsets
+	narrow.insert(500, 5);
+	plain.insert(500, 5);
+	narrow[495] = 4;
+	plain[495] = 4;
+	CHECK(narrow.keyBase() == 495);
+	sameLookups(narrow, plain, {494, 495, 500, 501, 1000, 1005, 1990, 1991});
+
+	// keys outside of the offset range are not inserted
+	auto count = narrow.count();
+	CHECK(narrow.insert(495 + 65536, 1) == narrow.constEnd() && narrow.count() == count);
+	CHECK(narrow.insert(1990 - 65536, 1) == narrow.constEnd() && narrow.count() == count);
+	std::int64_t keys[] = {70000, 70001};
+	std::int32_t values[] = {1, 2};
+	CHECK(!narrow.appendBulk(keys, values, 2) && narrow.count() == count);
+	CHECK(narrow.emplace(100000, 1) == narrow.constEnd());
+	narrow[100000] = 1;
+	CHECK(narrow.count() == count && !narrow.contains(100000));
+	narrow.insert(495 + 65535, 1);
+	CHECK(narrow.count() == count + 1 && narrow.lastKey() == 495 + 65535);
+
+	// an emptied map takes the base of its next first key
+	narrow.clear();
+	narrow.insert(1'000'000, 1);
+	CHECK(narrow.keyBase() == 1'000'000 && narrow.value(1'000'000) == 1);
+}
+
+// both appendBulk() overloads on maps that already hold keys
+static void appends()
+{
+	const std::int64_t base = 1'700'000'000'000'000'000;
+	Map<KeyEncoding::Offset32> narrow;
+	narrow.insert(base, 0);
+	std::vector<std::pair<std::int64_t, std::int32_t>> range = {{base + 10, 1}, {base + 20, 2}};
+	CHECK(narrow.appendBulk(range) && narrow.count() == 3 && narrow.keyBase() == base);
+	std::int64_t keys[] = {base + 30, base + 40};
+	std::int32_t values[] = {3, 4};
+	CHECK(narrow.appendBulk(keys, values, 2) && narrow.count() == 5 && narrow.lastKey() == base + 40);
+	CHECK(narrow.value(base + 20) == 2 && narrow.value(base + 40) == 4);
+	// late or out of range keys append nothing
+	range = {{base + 35, 5}, {base + 50, 6}};
+	CHECK(!narrow.appendBulk(range) && narrow.count() == 5);
+	range = {{base + 50, 5}, {base + (std::int64_t(1) << 33), 6}};
+	CHECK(!narrow.appendBulk(range) && narrow.count() == 5);
+
+	// a small base stays where it is
+	Map<KeyEncoding::Offset16> small;
+	small.insert(1000, 0);
+	range = {{1010, 1}, {1020, 2}};
+	CHECK(small.appendBulk(range) && small.keyBase() == 1000 && small.count() == 3 && small.value(1020) == 2);
+	// and an empty map takes the first key of the range
+	Map<KeyEncoding::Offset16> empty;
+	CHECK(empty.appendBulk(range) && empty.keyBase() == 1010 && empty.firstKey() == 1010 && empty.lastKey() == 1020);
+	Map<KeyEncoding::Offset32> joined;
+	CHECK(joined.insertAfterEnd(narrow) && joined.keyBase() == base && joined == narrow);
+	Map<KeyEncoding::Offset32> prepended;
+	prepended.insert(base + 100, 9);
+	CHECK(prepended.insertAtBegining(narrow) && prepended.keyBase() == base && prepended.count() == 6);
+	CHECK(prepended.value(base + 100) == 9 && prepended.value(base + 10) == 1);
+}
+
+static void copies()
+{
+	Map<KeyEncoding::Offset32> a;
+	Map<KeyEncoding::Offset32> b;
+	for (std::int64_t k = 0; k < 1000; k++)
+	{
+		a.insert(1'000'000 + k*3, int(k));
+		b.insert(2'000'000 + k*3, int(k));
+	}
+	// other maps are re-encoded on the base of this one
+	Map<KeyEncoding::Offset32> c = a;
+	CHECK(c == a && c.insertAfterEnd(b) && c.count() == 2000 && c.value(2'000'003) == 1 && c.keyBase() == 1'000'000);
+	Map<KeyEncoding::Offset32> d = b;
+	CHECK(d.insertAtBegining(a) && d.keyBase() == 1'000'000 && d.count() == 2000);
+	CHECK(c == d);
+	auto m = c.mid(1'000'300, 2'000'300);
+	CHECK(m.firstKey() == 1'000'300 && m.lastKey() == 2'000'300 && m.value(2'000'000) == 0);
+	// equal content on different bases
+	Map<KeyEncoding::Offset32> e;
+	e.insert(0, 0);
+	e.remove(0);
+	for (auto it = a.constBegin(); it != a.constEnd(); ++it)
+		e.insert(it.key(), it.value());
+	e.insert(999'000, -1);
+	e.remove(999'000);
+	CHECK(e.keyBase() != a.keyBase() && e == a);
+
+	// copy on write keeps the base with the shared buffer
+	Map<KeyEncoding::Offset32, FindAlgorithm::BinarySeparation, CopyMode::OnWrite> f;
+	for (std::int64_t k = 0; k < 100; k++)
+		f.insert(5'000'000 + k, int(k));
+	auto g = f;
+	g.insert(4'999'000, -1);
+	CHECK(!g.isSharedWith(f) && f.keyBase() == 5'000'000 && f.value(5'000'050) == 50 && g.value(5'000'050) == 50);
+	CHECK(g.keyBase() == 4'999'000 && g.firstKey() == 4'999'000 && f.firstKey() == 5'000'000);
+}
+
+static void joins()
+{
+	Map<KeyEncoding::Offset32> left;
+	Map<KeyEncoding::Full> plainLeft;
+	OrderedKeyMap<std::int64_t, std::int32_t> right;
+	for (std::int64_t k = 0; k < 1000; k++)
+	{
+		left.insert(1'000'000 + k*7, int(k));
+		plainLeft.insert(1'000'000 + k*7, int(k));
+		right.insert(1'000'000 + k*5, int(k));
+	}
+	CHECK(asOfJoin(left, right, std::int64_t(3)) == asOfJoin(plainLeft, right, std::int64_t(3)));
+	CHECK(innerJoin(left, right) == innerJoin(plainLeft, right));
+	CHECK(asOfJoinValues(left, right) == asOfJoinValues(plainLeft, right));
+}
+
+int main()
+{
+	lookups<KeyEncoding::Offset32, FindAlgorithm::BinarySeparation>();
+	lookups<KeyEncoding::Offset32, FindAlgorithm::RelativePrediction>();
+	lookups<KeyEncoding::Offset16, FindAlgorithm::BinarySeparation>();
+	lookups<KeyEncoding::Offset16, FindAlgorithm::RelativePrediction>();
+	rebase();
+	appends();
+	copies();
+	joins();
+	return 0;
+}
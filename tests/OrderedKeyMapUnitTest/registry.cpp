@@ -0,0 +1,209 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <smitto/okm.h>
+#include <smitto/okr.h>
+#include "check.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+using namespace Smitto;
+
+typedef OrderedKeyMap<std::int64_t, std::int64_t> Map;
+typedef OrderedKeyMapRegistry<Map> Registry;
+
+// spins until done() or a generous timeout, so a broken executor fails the test instead of hanging it
+template <typename FN>
+static bool waitFor(FN done)
+{
+	auto until = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (!done())
+	{
+		if (std::chrono::steady_clock::now() > until)
+			return false;
+		std::this_thread::yield();
+	}
+	return true;
+}
+
+static std::thread::id threadOf(OrderedKeyExecutor& executor, int worker)
+{
+	std::thread::id id;
+	executor.post(worker, [&id]() {id = std::this_thread::get_id();});
+	executor.wait();
+	return id;
+}
+
+static void pinning()
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CHECK(sched_getaffinity(0, sizeof(set), &set) == 0);
+	OrderedKeyExecutor executor(2);
+	for (int i = 0; i < executor.threads(); i++)
+		CHECK(executor.cpu(i) < 0 || CPU_ISSET(executor.cpu(i), &set));
+	// more workers than allowed cpus are not pinned
+	OrderedKeyExecutor crowded(CPU_COUNT(&set) + 1);
+	for (int i = 0; i < crowded.threads(); i++)
+		CHECK(crowded.cpu(i) == -1);
+	// a cpu that cannot be used is reported as not pinned
+	int allowed = 0;
+	while (!CPU_ISSET(allowed, &set))
+		allowed++;
+	OrderedKeyExecutor listed(2, {allowed, CPU_SETSIZE - 1});
+	CHECK(listed.cpu(0) == allowed && listed.cpu(1) == -1);
+#endif
+}
+
+static void executorWait()
+{
+	OrderedKeyExecutor executor(4);
+	std::atomic<int> done{0};
+	for (int round = 0; round < 20; round++)
+	{
+		for (int i = 0; i < 100; i++)
+		{
+			executor.post(i, [&done]() {done.fetch_add(1);});
+			executor.spawn(i, [&done]() {done.fetch_add(1);});
+		}
+		executor.wait();
+		CHECK(done.load() == (round + 1)*200);
+	}
+	executor.wait();
+}
+
+// stealable tasks of a busy worker run on the others
+static void stealing()
+{
+	OrderedKeyExecutor executor(4);
+	auto busy = threadOf(executor, 0);
+	constexpr int tasks = 50;
+	std::atomic<bool> started{false};
+	std::atomic<int> done{0}, stolen{0};
+	executor.post(0, [&]() {started = true; CHECK(waitFor([&]() {return done.load() == tasks;}));});
+	CHECK(waitFor([&]() {return started.load();}));
+	for (int i = 0; i < tasks; i++)
+		executor.spawn(0, [&]() {stolen += std::this_thread::get_id() != busy; done++;});
+	executor.wait();
+	CHECK(done.load() == tasks && stolen.load() == tasks);
+}
+
+static void updates(Registry& registry, const std::vector<Registry::SymbolId>& ids)
+{
+	// the log of a shard is only written by tasks of that shard
+	std::vector<std::vector<std::pair<Registry::SymbolId, int>>> logs(registry.executor().threads());
+	std::vector<std::vector<std::pair<Registry::SymbolId, int>>> calls(logs.size());
+	for (int k = 0; k < 2000; k++)
+	{
+		auto id = ids[(k*7) % ids.size()];
+		auto shard = registry.shardOf(id);
+		calls[shard].emplace_back(id, k);
+		registry.update(id, [&log = logs[shard], id, k](Map& map) {
+			log.emplace_back(id, k);
+			map.insert(map.isEmpty() ? 0 : map.lastKey() + 1, k);
+		});
+	}
+	registry.wait();
+	CHECK(logs == calls);
+	// and so the values of every map are in call order
+	for (auto id : ids)
+	{
+		auto map = registry.map(id);
+		for (std::int64_t i = 1; i < map->count(); i++)
+			CHECK(map->dataAt(i-1).value < map->dataAt(i).value);
+	}
+}
+
+static void forEachSteals(Registry& registry, const std::vector<Registry::SymbolId>& ids)
+{
+	auto busy = threadOf(registry.executor(), 0);
+	std::atomic<int> done{0};
+	std::atomic<bool> blocked{false};
+	std::mutex mutex;
+	std::map<Registry::SymbolId, std::pair<std::int64_t, std::thread::id>> seen;
+	// the first symbol shard 0 takes holds it until all the others are done
+	registry.forEach([&](Registry::SymbolId id, const Map& map) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			seen[id] = {map.count(), std::this_thread::get_id()};
+		}
+		if (std::this_thread::get_id() == busy && !blocked.exchange(true))
+			CHECK(waitFor([&]() {return done.load() == int(ids.size()) - 1;}));
+		done++;
+	});
+	CHECK(done.load() == int(ids.size()) && seen.size() == ids.size());
+	int stolen = 0;
+	for (auto id : ids)
+	{
+		CHECK(seen[id].first == registry.map(id)->count());
+		stolen += registry.shardOf(id) == 0 && seen[id].second != busy;
+	}
+	CHECK(stolen > 0);
+}
+
+static void learning()
+{
+	const char* path = "registry_history.txt";
+	Registry::Options options;
+	options.shards = 2;
+	{
+		Registry registry(options);
+		registry.add({1, 2});
+		CHECK(registry.initialReserve(1) == options.unknownReserve);
+		registry.update(1, [](Map& map) {for (std::int64_t k = 0; k < 100; k++) map.insert(k, k);});
+		registry.update(2, [](Map& map) {for (std::int64_t k = 0; k < 10; k++) map.insert(k, k);});
+		registry.endSession();
+		CHECK(registry.initialReserve(1) == 125 && registry.initialReserve(2) == options.minReserve);
+		CHECK(registry.initialReserve(3) == options.unknownReserve);
+		CHECK(registry.saveHistory(path));
+	}
+	{
+		Registry registry(options);
+		CHECK(registry.loadHistory(path) && registry.initialReserve(1) == 125);
+		registry.add({1, 2});
+		// shrinks halfway, grows at once
+		registry.update(1, [](Map& map) {for (std::int64_t k = 0; k < 40; k++) map.insert(k, k);});
+		registry.update(2, [](Map& map) {for (std::int64_t k = 0; k < 50; k++) map.insert(k, k);});
+		registry.endSession();
+		CHECK(registry.initialReserve(1) == 87 && registry.initialReserve(2) == 62);
+	}
+	Registry registry(options);
+	CHECK(!registry.loadHistory("missing/registry_history.txt"));
+	std::remove(path);
+}
+
+int main()
+{
+	pinning();
+	executorWait();
+	stealing();
+
+	Registry::Options options;
+	options.shards = 4;
+	Registry registry(options);
+	std::vector<Registry::SymbolId> ids;
+	for (Registry::SymbolId id = 100; id < 140; id++)
+		ids.push_back(id);
+	registry.add(ids);
+	CHECK(registry.symbols() == ids);
+	for (auto id : ids)
+		CHECK(registry.contains(id) && registry.shardOf(id) >= 0 && registry.shardOf(id) < 4 && registry.map(id)->isEmpty());
+	updates(registry, ids);
+	forEachSteals(registry, ids);
+	learning();
+	return 0;
+}
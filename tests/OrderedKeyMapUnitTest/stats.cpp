@@ -0,0 +1,126 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <smitto/okm.h>
+#include "check.h"
+
+using namespace Smitto;
+
+template <FindAlgorithm FINDALGORITHM, StatsMode STATSMODE, CopyMode COPYMODE = CopyMode::Deep>
+using Map = OrderedKeyMap<std::int64_t, std::int64_t, FINDALGORITHM, COPYMODE, STATSMODE>;
+
+static double meanProbes(const OrderedKeyMapStats& s)
+{
+	std::uint64_t sum = 0;
+	for (int i = 0; i < OrderedKeyMapStats::probeBuckets; i++)
+		sum += s.probes[i]*i;
+	return double(sum)/s.searches();
+}
+
+template <StatsMode STATSMODE>
+static void counters()
+{
+	Map<FindAlgorithm::BinarySeparation, STATSMODE> map(16);
+	for (std::int64_t k = 0; k < 1024; k++)
+		map.insert(k*2, k);
+	auto s = map.stats();
+	CHECK(s.middleInserts == 0 && s.middleRemoves == 0 && s.bytesMoved == 0 && s.misses == 0 && s.detaches == 0);
+	CHECK(s.realocs > 0 && s.peakCapacity >= 1024*sizeof(typename decltype(map)::Pair));
+
+	typedef typename decltype(map)::Pair Pair;
+	map.insert(1, -1);
+	map.remove(4);
+	map.remove(2046);
+	s = map.stats();
+	CHECK(s.middleInserts == 1 && s.middleRemoves == 1 && s.bytesMoved == (1023 + 1021)*sizeof(Pair));
+
+	// misses of the value lookups, not of find() or contains()
+	const auto& cmap = map;
+	map.value(3);
+	cmap[5];
+	map.valueNearPos(7, 3);
+	CHECK(!map.contains(9) && map.find(9) == map.constEnd());
+	CHECK(map.stats().misses == 3);
+	decltype(map) empty;
+	empty.first();
+	empty.last();
+	std::as_const(empty).first();
+	std::as_const(empty).last();
+	CHECK(empty.stats().misses == 4);
+
+	// a search per lookup between the first and the last key, by its probe count
+	auto before = map.stats().searches();
+	for (std::int64_t k = 1; k < 101; k++)
+		map.contains(k*10);
+	map.contains(0);
+	map.contains(2044);
+	s = map.stats();
+	CHECK(s.searches() - before == 100 && s.probes[0] == 0 && meanProbes(s) > 5);
+}
+
+// evenly spaced keys are found by a prediction in fewer probes than by a binary search
+static void histogram()
+{
+	Map<FindAlgorithm::BinarySeparation, StatsMode::Local> binary;
+	Map<FindAlgorithm::RelativePrediction, StatsMode::Local> relative;
+	for (std::int64_t k = 0; k < 100'000; k++)
+	{
+		binary.insert(k*3, k);
+		relative.insert(k*3, k);
+	}
+	for (std::int64_t k = 1; k < 1000; k++)
+	{
+		CHECK(binary.contains(k*297));
+		CHECK(relative.contains(k*297));
+	}
+	auto b = binary.stats(), r = relative.stats();
+	CHECK(b.searches() == 999 && r.searches() == 999);
+	CHECK(meanProbes(b) > 10 && meanProbes(r) < meanProbes(b));
+}
+
+static void detaches()
+{
+	Map<FindAlgorithm::BinarySeparation, StatsMode::Local, CopyMode::OnWrite> a;
+	for (std::int64_t k = 0; k < 100; k++)
+		a.insert(k, k);
+	auto b = a;
+	auto realocs = b.stats().realocs;
+	b.insert(50, -1);
+	CHECK(b.stats().detaches == 1 && b.stats().realocs == realocs);
+	b.insert(51, -1);
+	CHECK(b.stats().detaches == 1 && a.stats().detaches == 0);
+}
+
+// searches from several threads are all counted
+static void atomicSearches()
+{
+	Map<FindAlgorithm::BinarySeparation, StatsMode::Atomic> map;
+	for (std::int64_t k = 0; k < 10'000; k++)
+		map.insert(k, k);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; t++)
+		threads.emplace_back([&map]() {for (std::int64_t k = 1; k < 1001; k++) CHECK(map.contains(k));});
+	for (auto& thread : threads)
+		thread.join();
+	CHECK(map.stats().searches() == 4000);
+}
+
+int main()
+{
+	counters<StatsMode::Local>();
+	counters<StatsMode::Atomic>();
+	static_assert(sizeof(Map<FindAlgorithm::BinarySeparation, StatsMode::None>) < sizeof(Map<FindAlgorithm::BinarySeparation, StatsMode::Local>));
+	Map<FindAlgorithm::BinarySeparation, StatsMode::None> none;
+	none.value(1);
+	CHECK(none.stats().misses == 0 && none.stats().searches() == 0);
+	histogram();
+	detaches();
+	atomicSearches();
+	return 0;
+}
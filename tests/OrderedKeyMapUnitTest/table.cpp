@@ -0,0 +1,41 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <cstdint>
+#include <smitto/okt.h>
+#include "check.h"
+
+using namespace Smitto;
+
+template <typename TABLE>
+static void columnRanges()
+{
+	TABLE table;
+	CHECK(table.template column<0>(0, 100).empty() && table.template column<0>(100, 0).empty());
+	for (std::int64_t k = 10; k <= 100; k += 10)
+		table.insert(k, double(k), std::int32_t(k/10));
+
+	auto range = table.template column<1>(20, 50);
+	CHECK(range.size() == 4 && range.front() == 2 && range.back() == 5);
+	range = table.template column<1>(15, 55);
+	CHECK(range.size() == 4 && range.front() == 2 && range.back() == 5);
+	CHECK(table.template column<0>(0, 1000).size() == 10);
+	CHECK(table.template column<0>(30, 30).size() == 1 && table.template column<0>(30, 30).front() == 30);
+	// no rows in the range
+	CHECK(table.template column<0>(31, 39).empty());
+	CHECK(table.template column<0>(0, 5).empty() && table.template column<0>(101, 200).empty());
+	// reversed bounds
+	CHECK(table.template column<0>(50, 20).empty());
+	CHECK(table.template column<0>(55, 45).empty());
+	CHECK(table.template column<0>(200, 0).empty());
+	CHECK(table.template column<0>(100, 10).empty());
+}
+
+int main()
+{
+	columnRanges<OrderedKeyTable<std::int64_t, double, std::int32_t>>();
+	columnRanges<OrderedKeyTable<NarrowKey<std::int64_t, std::uint16_t>, double, std::int32_t>>();
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+ * Copyright (C) 2016-2023 Vladimir Kuznetsov <smithcoder@yandex.ru> https://smithcoder.ru
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <smitto/okm.h>
+#include "check.h"
+
+using namespace Smitto;
+
+using Map = OrderedKeyMap<std::int64_t, std::string>;
+using Reference = std::map<std::int64_t, std::string>;
+
+static_assert(!Map::trivialPairs && !Map::relocatablePairs);
+
+// longer than the small string buffer, so a lost or doubled destructor shows up under ASan
+static std::string text(std::int64_t key, int version = 0)
+{
+	return "value of key " + std::to_string(key) + " version " + std::to_string(version) + std::string(16, '.');
+}
+
+static void same(const Map& map, const Reference& ref)
+{
+	CHECK(map.count() == std::int64_t(ref.size()));
+	if (ref.empty())
+		return;
+	CHECK(map.firstKey() == ref.begin()->first && map.lastKey() == ref.rbegin()->first);
+	std::int64_t pos = 0;
+	for (const auto& [key, value] : ref)
+	{
+		CHECK(map.keyAt(pos) == key && map.dataAt(pos).value == value);
+		pos++;
+	}
+}
+
+// Every element-wise path: appends, inserts at the beginning and in the middle, removes of the first, middle
+// and last pair, reallocations, copies, mid(), trimAfter() and clear().
+static void mutations()
+{
+	std::mt19937_64 rnd(7);
+	Map map;
+	Reference ref;
+	for (int step = 0; step < 20000; step++)
+	{
+		auto op = rnd() % 100;
+		std::int64_t key = ref.empty() ? 1000 : std::int64_t(rnd() % 4000);
+		if (op < 40)
+		{
+			// appends after the last key
+			key = ref.empty() ? 1000 : ref.rbegin()->first + 1 + std::int64_t(rnd() % 3);
+			map.insert(key, text(key));
+			ref[key] = text(key);
+		}
+		else if (op < 60)
+		{
+			map.insert(key, text(key, step));
+			ref[key] = text(key, step);
+		}
+		else if (op < 65)
+		{
+			map.emplace(key, text(key, -step));
+			ref[key] = text(key, -step);
+		}
+		else if (op < 85)
+		{
+			if (!ref.empty() && op % 3 == 0)
+				key = op % 2 ? ref.begin()->first : ref.rbegin()->first;
+			map.remove(key);
+			ref.erase(key);
+		}
+		else if (op < 90)
+		{
+			Map copy = map;
+			CHECK(copy == map);
+			copy.insert(key, "changed");
+			map = copy;
+			ref[key] = "changed";
+		}
+		else if (op < 95)
+		{
+			auto it = ref.lower_bound(key);
+			map.trimAfter(key);
+			if (it != ref.begin() && it != ref.end())
+				ref.erase(std::next(it), ref.end());
+		}
+		else if (op < 98 && !ref.empty())
+		{
+			// mid() ends at the first key not less than to
+			auto from = ref.begin()->first + 10, to = ref.rbegin()->first - 10;
+			auto end = ref.lower_bound(to);
+			if (from <= to && end != ref.end() && ref.lower_bound(from) != ref.end() && ref.lower_bound(from)->first <= end->first)
+				same(map.mid(from, to), Reference(ref.lower_bound(from), std::next(end)));
+		}
+		else if (op == 99)
+		{
+			map.clear();
+			ref.clear();
+		}
+		same(map, ref);
+	}
+}
+
+static void bulk()
+{
+	Map map;
+	std::int64_t keys[] = {10, 20, 30};
+	std::string values[] = {text(10), text(20), text(30)};
+	CHECK(map.appendBulk(keys, values, 3));
+	std::vector<std::pair<std::int64_t, std::string>> range = {{40, text(40)}, {50, text(50)}};
+	CHECK(map.appendBulk(range) && map.count() == 5 && map.value(50) == text(50));
+
+	Map tail;
+	for (std::int64_t key = 100; key < 200; key++)
+		tail.insert(key, text(key));
+	Map head;
+	head.insert(0, text(0));
+	CHECK(map.insertAfterEnd(tail) && map.count() == 105 && map.value(150) == text(150));
+	CHECK(map.insertAtBegining(head) && map.count() == 106 && map.firstKey() == 0 && map.value(0) == text(0));
+	CHECK(tail.count() == 100 && tail.value(100) == text(100));
+}
+
+// float and double are compared bitwise, as with memcmp before
+static void floatingPoint()
+{
+	OrderedKeyMap<std::int64_t, double> a;
+	a.insert(1, NAN);
+	a.insert(2, 2.0);
+	auto b = a;
+	CHECK(a == b && a.equal(b));
+	b.insert(3, -0.0);
+	a.insert(3, 0.0);
+	CHECK(!(a == b));
+
+	OrderedKeyMap<std::int32_t, double> padded;
+	padded.insert(1, NAN);
+	auto copy = padded;
+	CHECK(padded == copy);
+}
+
+int main()
+{
+	mutations();
+	bulk();
+	floatingPoint();
+	return 0;
+}